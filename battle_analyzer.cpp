@@ -0,0 +1,312 @@
+// Answers questions about recorded battles from their event logs (soldier_w_turns --events=FILE,
+// event_log.h) without fighting them again.
+//     battle_analyzer [--threads=N] [--ticks=A:B] [--top=N] [--ticks-csv=FILE] [--soldier=marines|bugs:ID] LOG...
+// Logs are mapped, not read, and their blocks scanned in parallel on the thread pool (threadpool.h):
+// the work is cut into a few contiguous runs of blocks per thread, each run sums into its own
+// Analysis, and the runs are merged in order at the end. Reports are per faction (attacks, hits, crits,
+// kills, saves and damage, with hit and crit rates), per tick (--ticks-csv) and per soldier (the top
+// killers of each side, and --soldier's whole history: its attacks, its kills and who killed it).
+// --ticks=A:B only decodes the blocks that hold those ticks, using the logs' tick index.
+// Several logs add up tick by tick and slot by slot, eg many runs of one scenario.
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "event_log.h"
+#include "threadpool.h"
+#include "turn_stats.h"
+
+// What one side did, as the turn stats count it (hits include crits), and the damage its blows dealt
+struct FactionTally {
+    SideTally tally;
+    uint64_t damage = 0;
+
+    void count(const BattleEvent& event) {
+        switch (event.kind()) {
+        case kCrit:
+            tally.crits++;
+            [[fallthrough]];
+        case kHit:
+            tally.hits++;
+            damage += uint64_t(event.damage);
+            [[fallthrough]];
+        case kMiss:
+            tally.attacks++;
+            break;
+        case kKill:
+            tally.kills++;
+            break;
+        case kSaved:
+            tally.saved++;
+            break;
+        }
+    }
+
+    void add(const FactionTally& other) {
+        tally.add(other.tally);
+        damage += other.damage;
+    }
+};
+
+// A soldier's part in the battle, for --soldier
+struct SoldierEvent {
+    BattleEvent event;
+    bool attacking;     // the soldier struck this blow, rather than took it
+};
+
+// Everything a run of blocks adds up to
+struct Analysis {
+    uint64_t events = 0;
+    uint32_t firstTick = UINT32_MAX;
+    uint32_t lastTick = 0;
+    FactionTally sides[2];                          // Marines, Bugs
+    std::vector<FactionTally> ticks[2];             // by tick - firstTick
+    std::unordered_map<uint32_t, uint64_t> kills[2];    // by killer slot
+    std::vector<SoldierEvent> soldier;
+
+    void count(const BattleEvent& event, bool top_killers, int watched_side, uint32_t watched) {
+        bool bugs = event.bugsAttacking();
+        ++events;
+        sides[bugs].count(event);
+        if (event.tick < firstTick || event.tick > lastTick) spanTicks(event.tick);
+        ticks[bugs][event.tick - firstTick].count(event);
+        if (top_killers && event.kind() == kKill) kills[bugs][event.attacker]++;
+        if (watched_side == int(bugs) && event.attacker == watched) {
+            soldier.push_back({event, true});
+        } else if (watched_side == int(!bugs) && event.target == watched) {
+            soldier.push_back({event, false});
+        }
+    }
+
+    // Adds another run's analysis, of the blocks after this one's
+    void merge(const Analysis& other) {
+        events += other.events;
+        if (other.events == 0) return;
+        spanTicks(other.firstTick);
+        spanTicks(other.lastTick);
+        for (int side = 0; side < 2; ++side) {
+            sides[side].add(other.sides[side]);
+            for (size_t t = 0; t < other.ticks[side].size(); ++t) {
+                ticks[side][other.firstTick + t - firstTick].add(other.ticks[side][t]);
+            }
+            for (const auto& [killer, count] : other.kills[side]) kills[side][killer] += count;
+        }
+        soldier.insert(soldier.end(), other.soldier.begin(), other.soldier.end());
+    }
+
+private:
+    // Widens the tick range to take in tick
+    void spanTicks(uint32_t tick) {
+        if (firstTick == UINT32_MAX) {
+            firstTick = lastTick = tick;
+        } else if (tick < firstTick) {
+            for (std::vector<FactionTally>& side : ticks) side.insert(side.begin(), firstTick - tick, FactionTally());
+            firstTick = tick;
+        } else if (tick > lastTick) {
+            lastTick = tick;
+        } else {
+            return;
+        }
+        for (std::vector<FactionTally>& side : ticks) side.resize(lastTick - firstTick + 1);
+    }
+};
+
+std::string rate(uint64_t part, uint64_t whole) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1) << (whole ? 100.0 * double(part) / double(whole) : 0.0) << "%";
+    return out.str();
+}
+
+void printFactions(const Analysis& analysis) {
+    std::cout << std::left << std::setw(10) << "" << std::right << std::setw(14) << "attacks" << std::setw(14) << "hits"
+              << std::setw(9) << "hit%" << std::setw(12) << "crits" << std::setw(9) << "crit%" << std::setw(12) << "kills"
+              << std::setw(12) << "saved" << std::setw(16) << "damage" << "\n";
+    for (int side = 0; side < 2; ++side) {
+        const FactionTally& faction = analysis.sides[side];
+        const SideTally& t = faction.tally;
+        std::cout << std::left << std::setw(10) << (side ? "Bugs" : "Marines") << std::right << std::setw(14) << t.attacks
+                  << std::setw(14) << t.hits << std::setw(9) << rate(t.hits, t.attacks) << std::setw(12) << t.crits
+                  << std::setw(9) << rate(t.crits, t.hits) << std::setw(12) << t.kills << std::setw(12) << t.saved
+                  << std::setw(16) << faction.damage << "\n";
+    }
+}
+
+void printTicks(const Analysis& analysis) {
+    if (analysis.events == 0) return;
+    std::cout << "Ticks " << analysis.firstTick << " to " << analysis.lastTick << ".";
+    for (int side = 0; side < 2; ++side) {
+        const std::vector<FactionTally>& ticks = analysis.ticks[side];
+        auto most = std::max_element(ticks.begin(), ticks.end(), [](const FactionTally& a, const FactionTally& b) {
+            return a.tally.kills < b.tally.kills;
+        });
+        std::cout << " Most " << (side ? "Bug" : "Marine") << " kills in a tick: " << most->tally.kills << " (tick "
+                  << analysis.firstTick + (most - ticks.begin()) << ").";
+    }
+    std::cout << "\n";
+}
+
+void writeTicksCsv(const Analysis& analysis, std::ostream& out) {
+    out << "tick,marine_attacks,marine_hits,marine_crits,marine_kills,marine_saved,marine_damage,"
+           "bug_attacks,bug_hits,bug_crits,bug_kills,bug_saved,bug_damage\n";
+    if (analysis.events == 0) return;
+    for (size_t t = 0; t < analysis.ticks[0].size(); ++t) {
+        out << analysis.firstTick + t;
+        for (const std::vector<FactionTally>& side : analysis.ticks) {
+            const SideTally& s = side[t].tally;
+            out << ',' << s.attacks << ',' << s.hits << ',' << s.crits << ',' << s.kills << ',' << s.saved << ',' << side[t].damage;
+        }
+        out << '\n';
+    }
+}
+
+void printTopKillers(const Analysis& analysis, size_t top) {
+    for (int side = 0; side < 2; ++side) {
+        std::vector<std::pair<uint32_t, uint64_t>> killers(analysis.kills[side].begin(), analysis.kills[side].end());
+        size_t shown = std::min(top, killers.size());
+        std::partial_sort(killers.begin(), killers.begin() + shown, killers.end(), [](const auto& a, const auto& b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+        std::cout << "Top " << (side ? "Bug" : "Marine") << " killers:";
+        for (size_t i = 0; i < shown; ++i) std::cout << (i ? ", #" : " #") << killers[i].first << " (" << killers[i].second << ")";
+        std::cout << (shown ? "\n" : " none\n");
+    }
+}
+
+void printSoldier(const Analysis& analysis, int side, uint32_t id) {
+    const char* name = side ? "Bug" : "Marine";
+    const char* enemy = side ? "Marine" : "Bug";
+    uint64_t attacks = 0, hits = 0, blows_taken = 0;
+    std::vector<const BattleEvent*> kills;
+    const BattleEvent* death = nullptr;
+    for (const SoldierEvent& entry : analysis.soldier) {
+        EventOutcome kind = entry.event.kind();
+        if (entry.attacking) {
+            attacks += kind <= kCrit;
+            hits += kind == kHit || kind == kCrit;
+            if (kind == kKill) kills.push_back(&entry.event);
+        } else {
+            blows_taken += kind == kHit || kind == kCrit;
+            if (kind == kKill) death = &entry.event;    // a slot refilled by a reinforcement can fall again; the last one is kept
+        }
+    }
+    std::cout << name << " #" << id << ": " << attacks << " attacks, " << hits << " hits, " << kills.size() << " kills, "
+              << blows_taken << " blows taken";
+    if (death) {
+        std::cout << ", killed on tick " << death->tick << " by " << enemy << " #" << death->attacker << "\n";
+    } else {
+        std::cout << ", never killed\n";
+    }
+    for (const BattleEvent* kill : kills) std::cout << "    tick " << kill->tick << ": killed " << enemy << " #" << kill->target << "\n";
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> paths;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency()) - 1;
+    uint32_t tick_from = 0, tick_to = UINT32_MAX;
+    size_t top = 10;
+    std::string ticks_csv;
+    int watched_side = -1;      // none
+    uint32_t watched = 0;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg.rfind("--threads=", 0) == 0) {
+                threads = std::stoul(arg.substr(10));
+            } else if (arg.rfind("--top=", 0) == 0) {
+                top = std::stoul(arg.substr(6));
+            } else if (arg.rfind("--ticks-csv=", 0) == 0) {
+                ticks_csv = arg.substr(12);
+            } else if (arg.rfind("--ticks=", 0) == 0) {
+                std::string range = arg.substr(8);
+                size_t colon = range.find(':');
+                tick_from = uint32_t(std::stoul(range.substr(0, colon)));
+                tick_to = colon == std::string::npos ? tick_from : uint32_t(std::stoul(range.substr(colon + 1)));
+            } else if (arg.rfind("--soldier=", 0) == 0) {
+                std::string soldier = arg.substr(10);
+                size_t colon = soldier.find(':');
+                std::string side = soldier.substr(0, colon);
+                if (colon == std::string::npos || (side != "marines" && side != "bugs")) throw std::invalid_argument(arg);
+                watched_side = side == "bugs";
+                watched = uint32_t(std::stoul(soldier.substr(colon + 1)));
+            } else {
+                paths.push_back(arg);
+            }
+        }
+    } catch (const std::exception&) {
+        paths.clear();
+    }
+    if (paths.empty()) {
+        std::cerr << "usage: " << argv[0] << " [--threads=N] [--ticks=A:B] [--top=N] [--ticks-csv=FILE]"
+                     " [--soldier=marines|bugs:ID] LOG...\n";
+        return 2;
+    }
+
+    try {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::unique_ptr<EventLogReader>> logs;
+        for (const std::string& path : paths) logs.push_back(std::make_unique<EventLogReader>(path));
+
+        // Every block that can hold the ticks asked for, log by log, in tick order within each
+        struct BlockRef {
+            const EventLogReader* log;
+            size_t block;
+        };
+        std::vector<BlockRef> blocks;
+        uint64_t mapped = 0;
+        for (const std::unique_ptr<EventLogReader>& log : logs) {
+            mapped += log->fileBytes();
+            for (size_t b = log->firstBlockOf(tick_from); b < log->blocks().size() && log->blocks()[b].firstTick <= tick_to; ++b) {
+                blocks.push_back({log.get(), b});
+            }
+        }
+
+        // A few runs of blocks per thread, so a slow run doesn't hold the rest up for long
+        ThreadPool pool(std::max<size_t>(1, threads), NumaTopology::detect());
+        size_t runs = std::min(blocks.size(), (std::max<size_t>(1, threads) + 1) * 4);
+        std::vector<Analysis> partials(runs);
+        bool whole = tick_from == 0 && tick_to == UINT32_MAX;
+        pool.parallelFor(0, runs, [&](size_t r) {
+            std::vector<BattleEvent> events;
+            Analysis& analysis = partials[r];
+            for (size_t i = blocks.size() * r / runs; i < blocks.size() * (r + 1) / runs; ++i) {
+                blocks[i].log->decode(blocks[i].block, events);
+                for (const BattleEvent& event : events) {
+                    if (whole || (event.tick >= tick_from && event.tick <= tick_to)) {
+                        analysis.count(event, top > 0, watched_side, watched);
+                    }
+                }
+            }
+        }, 1);
+
+        Analysis analysis;
+        for (const Analysis& partial : partials) analysis.merge(partial);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << logs.size() << " log(s), " << mapped / (1 << 20) << "MiB mapped. " << analysis.events << " events from "
+                  << blocks.size() << " block(s) in " << std::fixed << std::setprecision(1) << ms << "ms ("
+                  << uint64_t(double(analysis.events) / std::max(ms, 0.001) / 1000) << "M events/s) on "
+                  << std::max<size_t>(1, threads) + 1 << " thread(s).\n" << std::defaultfloat;
+        printFactions(analysis);
+        printTicks(analysis);
+        if (top > 0) printTopKillers(analysis, top);
+        if (watched_side >= 0) printSoldier(analysis, watched_side, watched);
+        if (!ticks_csv.empty()) {
+            std::ofstream out(ticks_csv);
+            writeTicksCsv(analysis, out);
+            if (!out) throw std::runtime_error("can't write " + ticks_csv);
+            std::cout << "Per-tick tallies written to " << ticks_csv << ".\n";
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
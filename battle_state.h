@@ -0,0 +1,488 @@
+// Battle state of the turns engine (soldier_w_turns.cpp) as plain data, and snapshots of it.
+// Every soldier is a 16-byte Combatant record in a MappedArray. A fresh soldier is all zero bytes,
+// so a force of any size starts out as an anonymous mapping the kernel zero-fills as it is touched.
+// A force is made of groups, each a run of soldiers of one UnitType, so soldiers don't need to
+// carry their type either. The unit types, the RNG, the turn counter and the kill ledger are plain
+// data too, so a checkpoint is a header followed by the raw arrays, each on a 64KiB boundary:
+//     [SnapshotHeader][unit types][marine groups][bug groups][marines][bugs][kill ledger][waves to come]
+// Reinforcements join a force at the start of a turn. They take the slots of fallen soldiers of
+// their type first and are appended after the rest, so a long battle of many waves stays the same
+// size. Each slot counts its generation, and the kill ledger records generations along with slots,
+// so a handle to a fallen soldier never names the reinforcement that took its place. A slot whose
+// generation has reached its limit is never reused, so the count can't wrap back to a stale handle.
+// Restoring maps the soldier arrays straight out of the file (copy-on-write) and only reads the
+// small sections and the ledger, so a battle of any size resumes in milliseconds. Checkpoints are written
+// to FILE.tmp and renamed over FILE, so a crash mid-write leaves the previous checkpoint intact.
+// The layout is versioned. Bump kSnapshotVersion whenever a record or the header changes.
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// SplitMix64. The whole random stream is one word, so a snapshot can carry it. SplitMix64 is
+// counter-based (draw k is a hash of the seed plus k), so keyed() can hand out any numbered stream
+// of a family directly. An antithetic stream mirrors every draw of the same stream: a roll of 1 is a
+// 10 and the first target the last, which is what paired variance-reduction runs need. The mirror
+// flag isn't part of a snapshot.
+struct BattleRng {
+    uint64_t state = 0;
+    bool antithetic = false;
+
+    // Stream `counter` of the family `key`, eg battle i of a sweep, without going through the ones before
+    // it. So a battle can be rerun, shared between configurations or added to later by its number.
+    static BattleRng keyed(uint64_t key, uint64_t counter) {
+        BattleRng family{BattleRng{key}.next() + counter * 0x9E3779B97F4A7C15ull};
+        return BattleRng{family.next()};
+    }
+
+    uint64_t next() { return antithetic ? ~draw() : draw(); }
+
+    // 1..sides, like rand() % sides + 1
+    int roll(int sides) {
+        int r = int(draw() % uint64_t(sides));
+        return (antithetic ? sides - 1 - r : r) + 1;
+    }
+    // 0..n-1
+    size_t below(size_t n) {
+        size_t r = size_t(draw() % n);
+        return antithetic ? n - 1 - r : r;
+    }
+
+private:
+    uint64_t draw() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+};
+
+// One soldier. All zero bytes is a fresh soldier at full health.
+struct Combatant {
+    int32_t wounds = 0;     // damage taken, health is the unit's max health minus this
+    uint32_t hits = 0;      // hits landed
+    uint32_t kills = 0;
+    uint8_t dead = 0;
+    uint8_t saveUsed = 0;   // a Bug's carapace has already saved it from a killing blow
+    uint16_t generation = 0;    // times the slot has gone to a reinforcement, at most UINT16_MAX
+};
+static_assert(sizeof(Combatant) == 16 && std::is_trivially_copyable_v<Combatant>);
+
+// Special rules a unit type can have
+enum UnitRule : uint32_t {
+    kOneTimeSave = 1,       // survives its first killing blow with saveHeal health back (a Bug's carapace)
+    kPiercingCrit = 2,      // its critical hits ignore saves
+};
+
+// Stats of one kind of soldier. An attack hits when a d10 rolls above accuracy, and a roll of
+// critRoll is a critical hit for double damage.
+struct UnitType {
+    char name[16];
+    int32_t maxHealth;
+    int32_t accuracy;
+    int32_t damage;
+    int32_t critRoll;
+    int32_t saveHeal;
+    uint32_t rules;         // UnitRule flags
+};
+static_assert(std::is_trivially_copyable_v<UnitType>);
+
+inline UnitType makeUnitType(const std::string& name, int32_t maxHealth, int32_t accuracy, int32_t damage,
+                             int32_t critRoll, int32_t saveHeal, uint32_t rules) {
+    UnitType type{};
+    std::strncpy(type.name, name.c_str(), sizeof(type.name) - 1);
+    type.maxHealth = maxHealth;
+    type.accuracy = accuracy;
+    type.damage = damage;
+    type.critRoll = critRoll;
+    type.saveHeal = saveHeal;
+    type.rules = rules;
+    return type;
+}
+
+// What's wrong with a unit type's stats, empty if nothing. Every unit must be able to kill: a d10
+// never rolls above 10, so accuracy 10 or more never hits, and a battle between units that can't
+// kill each other never ends. Both unit tables (unit_types.h) and scenarios (scenario.h) check this.
+inline std::string unitTypeProblem(const UnitType& type) {
+    if (type.maxHealth < 1) return "health must be at least 1";
+    if (type.accuracy < 0 || type.accuracy > 9) return "accuracy must be 0 to 9 (a d10 has to be able to roll above it)";
+    if (type.damage < 1) return "damage must be at least 1";
+    if (type.critRoll < 0) return "crit can't be negative";
+    if (type.saveHeal < 0) return "heal can't be negative";
+    return {};
+}
+
+// The two units the game has always had
+inline std::vector<UnitType> defaultUnitTypes() {
+    return {
+        makeUnitType("Marine", 100, 7, 50, 10, 0, 0),
+        makeUnitType("Bug", 100, 8, 50, 10, 50, kOneTimeSave | kPiercingCrit),
+    };
+}
+
+// Soldiers [begin, end) of a force are all of unit type `type`
+struct ForceGroup {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t begin;
+    uint64_t end;
+};
+static_assert(std::is_trivially_copyable_v<ForceGroup>);
+
+// Group that soldier `index` belongs to. Forces have a handful of groups, so a scan is fine.
+inline const ForceGroup& groupOf(const std::vector<ForceGroup>& groups, uint64_t index) {
+    for (const ForceGroup& group : groups) {
+        if (index < group.end) return group;
+    }
+    return groups.back();
+}
+
+// Checks that groups cover soldiers [0, count) in order and only use known unit types.
+// Returns what's wrong, or an empty string.
+inline std::string checkGroups(const std::vector<ForceGroup>& groups, uint64_t count, size_t typeCount) {
+    if (groups.empty()) return "a force has no groups";
+    uint64_t next = 0;
+    for (const ForceGroup& group : groups) {
+        if (group.type >= typeCount) return "a group uses unit type " + std::to_string(group.type) + " of " + std::to_string(typeCount);
+        if (group.begin != next || group.end <= group.begin) return "force groups don't line up";
+        next = group.end;
+    }
+    if (next != count) return "force groups cover " + std::to_string(next) + " of " + std::to_string(count) + " soldiers";
+    return "";
+}
+
+// Who killed whom, and when
+struct KillRecord {
+    uint32_t turn;
+    uint32_t killer;        // index in the killer's force
+    uint32_t victim;        // index in the victim's force
+    uint32_t marineKilled;  // 1 if the victim was a Marine
+    uint16_t killerGeneration;  // generations of the two slots at the time
+    uint16_t victimGeneration;
+};
+static_assert(std::is_trivially_copyable_v<KillRecord>);
+
+// A soldier by slot and generation. It stays valid when the slot is reused, and then names nobody.
+struct SoldierHandle {
+    uint32_t index;
+    uint16_t generation;
+};
+
+inline SoldierHandle killerOf(const KillRecord& kill) { return {kill.killer, kill.killerGeneration}; }
+inline SoldierHandle victimOf(const KillRecord& kill) { return {kill.victim, kill.victimGeneration}; }
+
+// A wave of `count` soldiers of unit type `type` joining a force at the start of `turn`
+struct Reinforcement {
+    uint32_t turn;
+    uint32_t bugs;          // 1 if they join the bug force
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t count;
+};
+static_assert(std::is_trivially_copyable_v<Reinforcement>);
+
+// Checks that waves use known unit types and bring someone. Returns what's wrong, or an empty string.
+inline std::string checkReinforcements(const std::vector<Reinforcement>& waves, size_t typeCount) {
+    for (const Reinforcement& wave : waves) {
+        if (wave.type >= typeCount) return "a wave uses unit type " + std::to_string(wave.type) + " of " + std::to_string(typeCount);
+        if (wave.count == 0) return "a wave has no soldiers";
+    }
+    return "";
+}
+
+// Array in its own mapping: anonymous and zero-filled, or a private copy-on-write view of part of a
+// file. Pages are only allocated or read in when first touched. Resizing copies into a new mapping.
+template<typename T>
+class MappedArray {
+    static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+    MappedArray() = default;
+
+    explicit MappedArray(size_t count) : count(count) {
+        map(-1, 0);
+    }
+
+    // count items starting at offset in the open file fd. offset must be a multiple of the page size.
+    MappedArray(int fd, uint64_t offset, size_t count) : count(count) {
+        map(fd, offset);
+    }
+
+    MappedArray(MappedArray&& other) noexcept : items(std::exchange(other.items, nullptr)), count(std::exchange(other.count, 0)) {}
+
+    MappedArray& operator=(MappedArray&& other) noexcept {
+        if (this != &other) {
+            unmap();
+            items = std::exchange(other.items, nullptr);
+            count = std::exchange(other.count, 0);
+        }
+        return *this;
+    }
+
+    ~MappedArray() { unmap(); }
+
+    // Moves the items into a new anonymous mapping of count items, zero-filled past the old end
+    void resize(size_t newCount) {
+        MappedArray bigger(newCount);
+        if (count && newCount) std::memcpy(bigger.items, items, std::min(count, newCount) * sizeof(T));
+        *this = std::move(bigger);
+    }
+
+    size_t size() const { return count; }
+    T* data() { return items; }
+    const T* data() const { return items; }
+    T& operator[](size_t i) { return items[i]; }
+    const T& operator[](size_t i) const { return items[i]; }
+    T* begin() { return items; }
+    T* end() { return items + count; }
+    const T* begin() const { return items; }
+    const T* end() const { return items + count; }
+
+private:
+    void map(int fd, uint64_t offset) {
+        if (count == 0) return;
+        int flags = fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_PRIVATE;
+        void* p = mmap(nullptr, count * sizeof(T), PROT_READ | PROT_WRITE, flags, fd, off_t(offset));
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("can't map " + std::to_string(count) + " records: " + std::strerror(errno));
+        }
+        items = static_cast<T*>(p);
+    }
+
+    void unmap() {
+        if (items) munmap(items, count * sizeof(T));
+        items = nullptr;
+    }
+
+    T* items = nullptr;
+    size_t count = 0;
+};
+
+struct BattleState {
+    std::vector<UnitType> types;
+    std::vector<ForceGroup> marineGroups;
+    std::vector<ForceGroup> bugGroups;
+    MappedArray<Combatant> marines;
+    MappedArray<Combatant> bugs;
+    std::vector<KillRecord> kills;
+    std::vector<Reinforcement> reinforcements;  // waves still to come, by turn
+    uint64_t retiredHits[2] = {0, 0};   // hits of fallen Marines and Bugs whose slots were reused
+    BattleRng rng;
+    uint32_t turn = 1;
+    bool marineTurn = true;     // whose half of the turn is next
+
+    BattleState() = default;
+
+    // Fresh forces of the default Marines and Bugs
+    BattleState(size_t marineCount, size_t bugCount, uint64_t seed) : types(defaultUnitTypes()),
+        marineGroups{{0, 0, 0, marineCount}}, bugGroups{{1, 0, 0, bugCount}},
+        marines(marineCount), bugs(bugCount), rng{seed} {}
+};
+
+// Brings a wave into its force and returns how many of it took fallen soldiers' slots. The dead of the
+// wave's type are found by a scan of that type's groups: waves are rare next to turns, and the scan
+// reads the records a turn reads anyway. Slots at the last generation stay dead rather than wrap.
+// The rest are appended, extending the last group if it is of the same type.
+inline uint64_t reinforce(BattleState& state, const Reinforcement& wave) {
+    MappedArray<Combatant>& force = wave.bugs ? state.bugs : state.marines;
+    std::vector<ForceGroup>& groups = wave.bugs ? state.bugGroups : state.marineGroups;
+    uint64_t& retired = state.retiredHits[wave.bugs ? 1 : 0];
+    uint64_t reused = 0;
+    for (const ForceGroup& group : groups) {
+        if (group.type != wave.type) continue;
+        for (uint64_t i = group.begin; i < group.end && reused < wave.count; ++i) {
+            Combatant& slot = force[i];
+            if (!slot.dead || slot.generation == UINT16_MAX) continue;
+            retired += slot.hits;
+            uint16_t generation = uint16_t(slot.generation + 1);
+            slot = Combatant();
+            slot.generation = generation;
+            ++reused;
+        }
+    }
+
+    uint64_t added = wave.count - reused;
+    if (added == 0) return reused;
+    uint64_t begin = force.size();
+    if (begin + added > UINT32_MAX) throw std::runtime_error("a wave would take a force past " + std::to_string(UINT32_MAX) + " soldiers");
+    force.resize(begin + added);
+    if (!groups.empty() && groups.back().type == wave.type) {
+        groups.back().end = begin + added;
+    } else {
+        groups.push_back({wave.type, 0, begin, begin + added});
+    }
+    return reused;
+}
+
+constexpr uint64_t kSectionAlign = 1 << 16;    // a multiple of every page size we run on
+
+// count records starting at offset in a snapshot or scenario file
+struct FileSection {
+    uint64_t offset;
+    uint64_t count;
+};
+
+inline uint64_t alignSection(uint64_t offset) {
+    return (offset + kSectionAlign - 1) / kSectionAlign * kSectionAlign;
+}
+
+constexpr char kSnapshotMagic[8] = {'B', 'H', 'S', 'N', 'A', 'P', '\r', '\n'};
+constexpr uint32_t kSnapshotVersion = 3;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t combatantSize;     // catches a record layout change that forgot to bump the version
+    uint64_t rngState;
+    uint32_t turn;
+    uint32_t marineTurn;
+    FileSection types;
+    FileSection marineGroups;
+    FileSection bugGroups;
+    FileSection marines;
+    FileSection bugs;
+    FileSection kills;
+    FileSection reinforcements;
+    uint64_t retiredHits[2];
+};
+
+// Closes the descriptor on the way out, exceptions included
+struct FileHandle {
+    int fd;
+    explicit FileHandle(int fd) : fd(fd) {}
+    ~FileHandle() { if (fd >= 0) ::close(fd); }
+    FileHandle(const FileHandle&) = delete;
+    FileHandle& operator=(const FileHandle&) = delete;
+};
+
+inline std::runtime_error snapshotError(const std::string& path, const std::string& what) {
+    return std::runtime_error(path + ": " + what);
+}
+
+// Whether section lies inside a file of size bytes, on a mappable boundary
+template<typename T>
+bool sectionFits(const FileSection& section, uint64_t size) {
+    return section.offset % kSectionAlign == 0 && section.offset <= size
+        && section.count <= (size - section.offset) / sizeof(T);
+}
+
+// Lays the next section out after the previous one
+template<typename T>
+FileSection nextSection(const FileSection& previous, size_t previousItemSize, size_t count) {
+    return {alignSection(previous.offset + previous.count * previousItemSize), count};
+}
+
+template<typename T>
+std::vector<T> readSection(int fd, const FileSection& section, const std::string& path) {
+    std::vector<T> items(section.count);
+    ssize_t bytes = ssize_t(section.count * sizeof(T));
+    if (bytes && pread(fd, items.data(), bytes, off_t(section.offset)) != bytes) {
+        throw snapshotError(path, "can't read " + std::to_string(section.count) + " records");
+    }
+    return items;
+}
+
+inline void saveSnapshot(const BattleState& state, const std::string& path) {
+    SnapshotHeader header{};
+    std::memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+    header.version = kSnapshotVersion;
+    header.combatantSize = sizeof(Combatant);
+    header.rngState = state.rng.state;
+    header.turn = state.turn;
+    header.marineTurn = state.marineTurn;
+    header.types = {alignSection(sizeof(header)), state.types.size()};
+    header.marineGroups = nextSection<ForceGroup>(header.types, sizeof(UnitType), state.marineGroups.size());
+    header.bugGroups = nextSection<ForceGroup>(header.marineGroups, sizeof(ForceGroup), state.bugGroups.size());
+    header.marines = nextSection<Combatant>(header.bugGroups, sizeof(ForceGroup), state.marines.size());
+    header.bugs = nextSection<Combatant>(header.marines, sizeof(Combatant), state.bugs.size());
+    header.kills = nextSection<KillRecord>(header.bugs, sizeof(Combatant), state.kills.size());
+    header.reinforcements = nextSection<Reinforcement>(header.kills, sizeof(KillRecord), state.reinforcements.size());
+    header.retiredHits[0] = state.retiredHits[0];
+    header.retiredHits[1] = state.retiredHits[1];
+    uint64_t size = header.reinforcements.offset + state.reinforcements.size() * sizeof(Reinforcement);
+
+    std::string tmp = path + ".tmp";
+    FileHandle file(::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644));
+    if (file.fd < 0) throw snapshotError(tmp, std::strerror(errno));
+    if (ftruncate(file.fd, off_t(size)) != 0) throw snapshotError(tmp, std::strerror(errno));
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file.fd, 0);
+    if (p == MAP_FAILED) throw snapshotError(tmp, std::strerror(errno));
+
+    char* base = static_cast<char*>(p);
+    auto copy = [base](const FileSection& section, const void* items, size_t itemSize) {
+        if (section.count) std::memcpy(base + section.offset, items, section.count * itemSize);
+    };
+    std::memcpy(base, &header, sizeof(header));
+    copy(header.types, state.types.data(), sizeof(UnitType));
+    copy(header.marineGroups, state.marineGroups.data(), sizeof(ForceGroup));
+    copy(header.bugGroups, state.bugGroups.data(), sizeof(ForceGroup));
+    copy(header.marines, state.marines.data(), sizeof(Combatant));
+    copy(header.bugs, state.bugs.data(), sizeof(Combatant));
+    copy(header.kills, state.kills.data(), sizeof(KillRecord));
+    copy(header.reinforcements, state.reinforcements.data(), sizeof(Reinforcement));
+    int synced = msync(p, size, MS_SYNC);
+    munmap(p, size);
+    if (synced != 0) throw snapshotError(tmp, std::strerror(errno));
+
+    // Only replace the last good checkpoint once this one is complete
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) throw snapshotError(path, std::strerror(errno));
+}
+
+inline BattleState loadSnapshot(const std::string& path) {
+    FileHandle file(::open(path.c_str(), O_RDONLY));
+    if (file.fd < 0) throw snapshotError(path, std::strerror(errno));
+    struct stat info;
+    if (fstat(file.fd, &info) != 0) throw snapshotError(path, std::strerror(errno));
+    uint64_t size = uint64_t(info.st_size);
+
+    SnapshotHeader header;
+    if (size < sizeof(header) || pread(file.fd, &header, sizeof(header), 0) != ssize_t(sizeof(header))) {
+        throw snapshotError(path, "too short to be a battle snapshot");
+    }
+    if (std::memcmp(header.magic, kSnapshotMagic, sizeof(header.magic)) != 0) {
+        throw snapshotError(path, "not a battle snapshot");
+    }
+    if (header.version != kSnapshotVersion || header.combatantSize != sizeof(Combatant)) {
+        throw snapshotError(path, "snapshot version " + std::to_string(header.version) + ", this build reads version "
+                                  + std::to_string(kSnapshotVersion));
+    }
+    if (!sectionFits<UnitType>(header.types, size) || !sectionFits<ForceGroup>(header.marineGroups, size)
+        || !sectionFits<ForceGroup>(header.bugGroups, size) || !sectionFits<Combatant>(header.marines, size)
+        || !sectionFits<Combatant>(header.bugs, size) || !sectionFits<KillRecord>(header.kills, size)
+        || !sectionFits<Reinforcement>(header.reinforcements, size)) {
+        throw snapshotError(path, "truncated snapshot");
+    }
+
+    BattleState state;
+    state.types = readSection<UnitType>(file.fd, header.types, path);
+    state.marineGroups = readSection<ForceGroup>(file.fd, header.marineGroups, path);
+    state.bugGroups = readSection<ForceGroup>(file.fd, header.bugGroups, path);
+    state.marines = MappedArray<Combatant>(file.fd, header.marines.offset, header.marines.count);
+    state.bugs = MappedArray<Combatant>(file.fd, header.bugs.offset, header.bugs.count);
+    state.kills = readSection<KillRecord>(file.fd, header.kills, path);
+    state.reinforcements = readSection<Reinforcement>(file.fd, header.reinforcements, path);
+    std::string problem = checkGroups(state.marineGroups, state.marines.size(), state.types.size());
+    if (problem.empty()) problem = checkGroups(state.bugGroups, state.bugs.size(), state.types.size());
+    if (problem.empty()) problem = checkReinforcements(state.reinforcements, state.types.size());
+    if (!problem.empty()) throw snapshotError(path, problem);
+    state.rng.state = header.rngState;
+    state.turn = header.turn;
+    state.marineTurn = header.marineTurn != 0;
+    state.retiredHits[0] = header.retiredHits[0];
+    state.retiredHits[1] = header.retiredHits[1];
+    return state;
+}
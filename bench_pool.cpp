@@ -0,0 +1,165 @@
+// Microbenchmarks for the thread pool in threadpool.h.
+// submit/execute: pushes batches of small tasks through the pool and counts heap allocations per task,
+// once with the lambda going straight into a Task and once the old way, wrapped in a std::function first,
+// plus submit() with its Future (and that future's one shared block) for comparison.
+// tick wake latency: short ticks of a few tasks each with idle gaps in between, as in the battle.
+// Measures how long a tick's first task waits to start after being posted, under each IdlePolicy,
+// and how much CPU the pool burns for it.
+// --perf adds hardware counters for the submitting thread in each submit/execute variant (perf_counters.h).
+// The capture is the size of a typical battle task (a few references and indices).
+// Build with: g++ -std=c++20 -O2 -pthread bench_pool.cpp -o bench_pool
+
+#include <iostream>
+#include <iomanip>
+#include <functional>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <ctime>
+
+#include "threadpool.h"
+#include "perf_counters.h"
+
+// Every heap allocation in the process goes through here so the benchmark can count them
+std::atomic<uint64_t> allocations{0};
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+// Submits `tasks` tasks in batches, waiting for each batch, and reports throughput and allocations per task.
+// makeTask(done, sink, i) returns whatever gets handed to send(), which queues it on the pool.
+template<typename MakeTask, typename Send>
+void benchSubmit(const char* label, size_t tasks, MakeTask makeTask, Send send) {
+    const size_t batch = 1024;
+    std::atomic<size_t> done{0};
+    std::atomic<uint64_t> sink{0};
+
+    auto runBatch = [&](size_t first, size_t count) {
+        size_t target = done.load() + count;
+        for (size_t i = first; i < first + count; ++i) {
+            send(makeTask(done, sink, i));
+        }
+        for (size_t seen = done.load(); seen < target; seen = done.load()) {
+            done.wait(seen);
+        }
+    };
+
+    // Warm up so the queues have already grown to batch size
+    runBatch(0, batch);
+
+    uint64_t allocationsBefore = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    {
+        PerfScope scope(PerfPhases::instance().phase(label));
+        for (size_t first = 0; first < tasks; first += batch) {
+            runBatch(first, std::min(batch, tasks - first));
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t allocated = allocations.load() - allocationsBefore;
+
+    std::cout << "  " << std::left << std::setw(16) << label << std::right
+              << std::setw(12) << static_cast<uint64_t>(tasks / seconds) << " tasks/s"
+              << std::setw(10) << std::fixed << std::setprecision(3) << double(allocated) / tasks << " allocs/task\n";
+}
+
+double cpuSeconds() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs `ticks` ticks of `width` tasks. Each tick posts its tasks as one batch and waits for them,
+// then leaves the pool idle for `gap` before the next tick. The wake latency of a tick is the time
+// from posting to the moment its first task starts running.
+void benchWake(const char* label, IdlePolicy policy, size_t workers, size_t ticks, size_t width,
+               std::chrono::microseconds gap) {
+    using Clock = std::chrono::steady_clock;
+    ThreadPool pool(workers, NumaTopology::detect(), policy);
+    std::vector<Clock::time_point> starts(width);
+    std::vector<double> latencies;
+    latencies.reserve(ticks);
+    std::atomic<size_t> done{0};
+
+    double cpuBefore = cpuSeconds();
+    auto wallBefore = Clock::now();
+    for (size_t tick = 0; tick < ticks; ++tick) {
+        std::this_thread::sleep_for(gap);
+        done = 0;
+        std::vector<Task> batch;
+        for (size_t i = 0; i < width; ++i) {
+            batch.emplace_back([&starts, &done, i]() {
+                starts[i] = Clock::now();
+                done.fetch_add(1);
+                done.notify_one();
+            });
+        }
+        auto posted = Clock::now();
+        pool.postBatch(batch.data(), batch.size());
+        for (size_t seen = done.load(); seen < width; seen = done.load()) {
+            done.wait(seen);
+        }
+        auto first = *std::min_element(starts.begin(), starts.end());
+        latencies.push_back(std::chrono::duration<double, std::micro>(first - posted).count());
+    }
+    double wall = std::chrono::duration<double>(Clock::now() - wallBefore).count();
+    double cpu = cpuSeconds() - cpuBefore;
+
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << "  " << std::left << std::setw(16) << label << std::right << std::fixed << std::setprecision(1)
+              << " median " << std::setw(7) << latencies[latencies.size() / 2] << " us"
+              << "   p99 " << std::setw(7) << latencies[latencies.size() * 99 / 100] << " us"
+              << "   cpu " << std::setw(5) << 100.0 * cpu / wall << "% of one core\n";
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--perf") PerfPhases::instance().enable();
+    }
+
+    const size_t tasks = 1000000;
+    int numCores = std::thread::hardware_concurrency();
+    ThreadPool pool(numCores - 1, NumaTopology::detect());
+
+    // Same work and capture for both: three references/indices plus some payload, 40 bytes in all
+    auto work = [](std::atomic<size_t>& done, std::atomic<uint64_t>& sink, size_t i) {
+        uint64_t a = i * 3, b = i ^ 0x5bd1e995;
+        return [&done, &sink, i, a, b]() {
+            sink.fetch_add(i + a + b, std::memory_order_relaxed);
+            done.fetch_add(1);
+            done.notify_one();
+        };
+    };
+
+    auto post = [&pool](auto&& task) { pool.post(std::move(task)); };
+    std::cout << "submit/execute, " << tasks << " tasks, " << pool.size() << " worker(s)\n";
+    benchSubmit("Task", tasks, [&](auto& done, auto& sink, size_t i) {
+        return work(done, sink, i);
+    }, post);
+    benchSubmit("std::function", tasks, [&](auto& done, auto& sink, size_t i) {
+        return std::function<void()>(work(done, sink, i));
+    }, post);
+    benchSubmit("Task + Future", tasks, [&](auto& done, auto& sink, size_t i) {
+        return work(done, sink, i);
+    }, [&pool](auto&& task) { pool.submit(std::move(task)); });
+    PerfPhases::instance().report(std::cout, "submitting thread");
+
+    // More workers than cores disables spinning, so the policies only differ when there's room
+    const size_t ticks = 2000, width = 4;
+    const auto gap = std::chrono::microseconds(50);
+    std::cout << "\ntick wake latency, " << ticks << " ticks of " << width << " tasks, " << gap.count()
+              << "us idle between ticks, " << pool.size() << " worker(s)\n";
+    benchWake("lowLatency", IdlePolicy::lowLatency(), pool.size(), ticks, width, gap);
+    benchWake("balanced", IdlePolicy::balanced(), pool.size(), ticks, width, gap);
+    benchWake("lowCpu", IdlePolicy::lowCpu(), pool.size(), ticks, width, gap);
+
+    return 0;
+}
@@ -0,0 +1,396 @@
+// Every attack of a battle, on disk in a few bytes each, for answering questions after the fact.
+// An event is one attack (tick, attacker, target, damage, outcome), plus a follow-up event when a
+// blow kills its target or a save turns it. Ticks are the battle's turns, and the outcome byte says
+// which side attacked. Soldiers are named by their slot in their force, as in the kill ledger.
+// The log is columnar. Events are cut into blocks of up to kEventBlock, and each column of a block
+// is stored on its own: tick, attacker, target and damage as varints of the zigzagged difference
+// from the event before, and the outcome bytes as they are. Within a turn attackers mostly come in
+// order and ticks and damage barely change, so most events take 5 to 8 bytes instead of 17.
+//     [EventLogHeader][block][block]...[EventBlockIndex per block][EventLogFooter]
+//     block: [EventBlockHeader][ticks][attackers][targets][damage][outcomes]
+// The index gives each block's ticks and file offset, so a reader finds a tick with a binary
+// search and decodes only the blocks that hold it.
+//     EventLogWriter log("battle.events");
+//     log.submit(std::move(events));       // each turn: encoded and written on the log's own thread
+//     log.close();                         // writes the index, renames FILE.tmp over FILE
+//     EventLogReader reader("battle.events");
+//     std::vector<BattleEvent> turn = reader.eventsAt(12);
+// The writer's thread takes batches off a bounded queue (threadpool.h), so the battle only waits
+// for it when it falls a whole queue behind. close() ends with an empty batch and joins the thread.
+// That relies on the queue waking a sleeping pop() for every batch published, however late its
+// producer finishes (test_queue.cpp checks both). A log that wasn't closed stays FILE.tmp, without
+// an index.
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "battle_state.h"
+#include "threadpool.h"
+
+enum EventOutcome : uint8_t {
+    kMiss,
+    kHit,
+    kCrit,
+    kKill,      // follow-up: the blow before it (by this attacker, on this target) was lethal
+    kSaved,     // follow-up: the target's one-time save turned it
+};
+constexpr uint8_t kBugsAttacking = 0x80;   // or'ed into outcome
+
+struct BattleEvent {
+    uint32_t tick;
+    uint32_t attacker;
+    uint32_t target;
+    int32_t damage;     // of the blow, before any save; 0 on a miss
+    uint8_t outcome;
+
+    EventOutcome kind() const { return EventOutcome(outcome & ~kBugsAttacking); }
+    bool bugsAttacking() const { return outcome & kBugsAttacking; }
+};
+
+constexpr char kEventLogMagic[8] = {'B', 'H', 'E', 'V', 'L', 'O', 'G', '\n'};
+constexpr uint32_t kEventLogVersion = 1;
+constexpr uint32_t kEventBlock = 65536;     // events
+constexpr size_t kEventColumns = 5;
+
+struct EventLogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t blockEvents;
+};
+
+struct EventBlockHeader {
+    uint32_t count;
+    uint32_t firstTick;
+    uint32_t lastTick;
+    uint32_t columnBytes[kEventColumns];
+};
+
+struct EventBlockIndex {
+    uint64_t offset;        // of the block's header
+    uint64_t firstEvent;    // events in the blocks before it
+    uint32_t firstTick;
+    uint32_t lastTick;
+};
+
+struct EventLogFooter {
+    uint64_t indexOffset;
+    uint64_t blocks;
+    uint64_t events;
+    char magic[8];
+};
+static_assert(std::is_trivially_copyable_v<BattleEvent> && sizeof(EventBlockHeader) == 32
+              && sizeof(EventBlockIndex) == 24 && sizeof(EventLogFooter) == 32);
+
+// Writes value at out, 7 bits a byte, and moves out past it
+inline void putVarint(uint8_t*& out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = uint8_t(value) | 0x80;
+        value >>= 7;
+    }
+    *out++ = uint8_t(value);
+}
+
+// Reads a varint from [p, end) and moves p past it. False if it runs off the end.
+inline bool getVarint(const uint8_t*& p, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Small differences either way make small varints
+inline uint64_t zigzag(int64_t value) { return (uint64_t(value) << 1) ^ uint64_t(value >> 63); }
+inline int64_t unzigzag(uint64_t value) { return int64_t(value >> 1) ^ -int64_t(value & 1); }
+
+class EventLogWriter {
+public:
+    // Creates path.tmp and starts the writer's thread. queued is how many batches may wait for it.
+    explicit EventLogWriter(std::string path, size_t queued = 16) : path(std::move(path)), tmp(this->path + ".tmp"),
+        queue(queued), spares(queued), file(::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) {
+        if (file.fd < 0) throw snapshotError(tmp, std::strerror(errno));
+        EventLogHeader header{};
+        std::memcpy(header.magic, kEventLogMagic, sizeof(header.magic));
+        header.version = kEventLogVersion;
+        header.blockEvents = kEventBlock;
+        put(&header, sizeof(header));
+        // The differences of 32-bit values take at most 5 bytes
+        for (std::vector<uint8_t>& column : columns) column.resize(size_t(kEventBlock) * 5);
+        writer = std::thread([this] { run(); });
+    }
+
+    ~EventLogWriter() {
+        if (!writer.joinable()) return;
+        try {
+            close();
+        } catch (const std::exception&) {
+            // Nobody to tell; the log stays FILE.tmp
+        }
+    }
+
+    EventLogWriter(const EventLogWriter&) = delete;
+    EventLogWriter& operator=(const EventLogWriter&) = delete;
+
+    // Queues a batch of events, waiting if the writer is a whole queue behind, and leaves events
+    // empty, with the room of a batch the writer is done with when there is one. Ticks must not go
+    // backwards from one batch to the next. Throws if writing has already failed.
+    void submit(std::vector<BattleEvent>& events) {
+        if (failed.load(std::memory_order_acquire)) std::rethrow_exception(error);
+        if (events.empty()) return;
+        queue.push(std::move(events));
+        if (!spares.tryPop(events)) events = std::vector<BattleEvent>();
+    }
+
+    // Writes what's queued, the index and the footer, and renames FILE.tmp over FILE
+    void close() {
+        if (!writer.joinable()) return;
+        queue.push({});     // an empty batch is the last
+        writer.join();
+        if (failed.load(std::memory_order_acquire)) std::rethrow_exception(error);
+
+        EventLogFooter footer{};
+        footer.indexOffset = offset;
+        footer.blocks = index.size();
+        footer.events = events;
+        std::memcpy(footer.magic, kEventLogMagic, sizeof(footer.magic));
+        put(index.data(), index.size() * sizeof(EventBlockIndex));
+        put(&footer, sizeof(footer));
+        if (fsync(file.fd) != 0) throw snapshotError(tmp, std::strerror(errno));
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) throw snapshotError(path, std::strerror(errno));
+    }
+
+    // Only final once the log is closed
+    uint64_t eventsWritten() const { return events; }
+    uint64_t bytesWritten() const { return offset; }
+
+private:
+    void run() {
+        while (true) {
+            std::vector<BattleEvent> batch = queue.pop();
+            if (batch.empty()) break;
+            if (failed.load(std::memory_order_relaxed)) continue;   // drain, so submit() never waits on a dead writer
+            try {
+                for (const BattleEvent& event : batch) add(event);
+            } catch (const std::exception&) {
+                fail();
+            }
+            batch.clear();
+            spares.tryPush(std::move(batch));
+        }
+        try {
+            if (blockEvents > 0) flush();
+        } catch (const std::exception&) {
+            fail();
+        }
+    }
+
+    void fail() {
+        error = std::current_exception();
+        failed.store(true, std::memory_order_release);
+    }
+
+    // Encodes event onto the block's columns, writing the block out when it is full
+    void add(const BattleEvent& event) {
+        if (event.tick < previous.tick) {
+            throw snapshotError(tmp, "events of tick " + std::to_string(event.tick) + " came after tick "
+                                     + std::to_string(previous.tick));
+        }
+        if (blockEvents == 0) {
+            blockFirstTick = event.tick;
+            for (size_t c = 0; c < kEventColumns; ++c) ends[c] = columns[c].data();
+            previous = BattleEvent{};
+        }
+        putVarint(ends[0], zigzag(int64_t(event.tick) - int64_t(previous.tick)));
+        putVarint(ends[1], zigzag(int64_t(event.attacker) - int64_t(previous.attacker)));
+        putVarint(ends[2], zigzag(int64_t(event.target) - int64_t(previous.target)));
+        putVarint(ends[3], zigzag(int64_t(event.damage) - int64_t(previous.damage)));
+        *ends[4]++ = event.outcome;
+        previous = event;
+        if (++blockEvents == kEventBlock) flush();
+    }
+
+    void flush() {
+        EventBlockHeader header{};
+        header.count = blockEvents;
+        header.firstTick = blockFirstTick;
+        header.lastTick = previous.tick;
+        for (size_t c = 0; c < kEventColumns; ++c) header.columnBytes[c] = uint32_t(ends[c] - columns[c].data());
+
+        index.push_back({offset, events, header.firstTick, header.lastTick});
+        put(&header, sizeof(header));
+        for (size_t c = 0; c < kEventColumns; ++c) put(columns[c].data(), header.columnBytes[c]);
+        events += blockEvents;
+        blockEvents = 0;
+    }
+
+    void put(const void* data, size_t bytes) {
+        const char* p = static_cast<const char*>(data);
+        while (bytes > 0) {
+            ssize_t n = ::write(file.fd, p, bytes);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throw snapshotError(tmp, std::strerror(errno));
+            p += n;
+            bytes -= size_t(n);
+            offset += uint64_t(n);
+        }
+    }
+
+    std::string path;
+    std::string tmp;
+    ThreadSafeQueue<std::vector<BattleEvent>> queue;
+    ThreadSafeQueue<std::vector<BattleEvent>> spares;   // written batches, for submit() to refill
+    FileHandle file;
+    std::thread writer;
+    std::atomic<bool> failed = false;
+    std::exception_ptr error;
+    // The writer's thread's own, until close() joins it
+    std::vector<uint8_t> columns[kEventColumns];
+    uint8_t* ends[kEventColumns] = {};
+    uint32_t blockEvents = 0;
+    uint32_t blockFirstTick = 0;
+    BattleEvent previous{};     // the last event added, tick included even after the block is written
+    std::vector<EventBlockIndex> index;
+    uint64_t offset = 0;
+    uint64_t events = 0;
+};
+
+// A closed log mapped read-only. Decoding is const, so threads can share a reader.
+class EventLogReader {
+public:
+    explicit EventLogReader(std::string path) : path(std::move(path)) {
+        FileHandle file(::open(this->path.c_str(), O_RDONLY));
+        if (file.fd < 0) throw snapshotError(this->path, std::strerror(errno));
+        struct stat info;
+        if (fstat(file.fd, &info) != 0) throw snapshotError(this->path, std::strerror(errno));
+        size = uint64_t(info.st_size);
+        if (size < sizeof(EventLogHeader) + sizeof(EventLogFooter)) throw snapshotError(this->path, "too short to be an event log");
+        void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file.fd, 0);
+        if (p == MAP_FAILED) throw snapshotError(this->path, std::strerror(errno));
+        bytes = static_cast<const uint8_t*>(p);
+
+        EventLogHeader header;
+        EventLogFooter footer;
+        std::memcpy(&header, bytes, sizeof(header));
+        std::memcpy(&footer, bytes + size - sizeof(footer), sizeof(footer));
+        std::string problem;
+        if (std::memcmp(header.magic, kEventLogMagic, sizeof(header.magic)) != 0) {
+            problem = "not an event log";
+        } else if (header.version != kEventLogVersion) {
+            problem = "event log version " + std::to_string(header.version) + ", this build reads version "
+                      + std::to_string(kEventLogVersion);
+        } else if (std::memcmp(footer.magic, kEventLogMagic, sizeof(footer.magic)) != 0) {
+            problem = "no index, the log wasn't closed";
+        } else if (footer.indexOffset > size - sizeof(footer)
+                   || footer.blocks != (size - sizeof(footer) - footer.indexOffset) / sizeof(EventBlockIndex)) {
+            problem = "bad index";
+        }
+        if (!problem.empty()) {
+            unmap();
+            throw snapshotError(this->path, problem);
+        }
+        index.resize(footer.blocks);
+        std::memcpy(index.data(), bytes + footer.indexOffset, index.size() * sizeof(EventBlockIndex));
+        events = footer.events;
+        indexOffset = footer.indexOffset;
+        madvise(p, size, MADV_SEQUENTIAL);
+    }
+
+    ~EventLogReader() { unmap(); }
+
+    EventLogReader(const EventLogReader&) = delete;
+    EventLogReader& operator=(const EventLogReader&) = delete;
+
+    const std::string& name() const { return path; }
+    uint64_t eventCount() const { return events; }
+    uint64_t fileBytes() const { return size; }
+    const std::vector<EventBlockIndex>& blocks() const { return index; }
+
+    // Replaces out with the events of block b
+    void decode(size_t b, std::vector<BattleEvent>& out) const {
+        const EventBlockIndex& entry = index.at(b);
+        if (entry.offset + sizeof(EventBlockHeader) > indexOffset) throw corrupt(b);
+        EventBlockHeader header;
+        std::memcpy(&header, bytes + entry.offset, sizeof(header));
+        const uint8_t* columns[kEventColumns];
+        const uint8_t* ends[kEventColumns];
+        uint64_t end = entry.offset + sizeof(header);
+        for (size_t c = 0; c < kEventColumns; ++c) {
+            columns[c] = bytes + end;
+            end += header.columnBytes[c];
+            if (end > indexOffset) throw corrupt(b);
+            ends[c] = bytes + end;
+        }
+        if (header.columnBytes[4] != header.count) throw corrupt(b);
+
+        // A row at a time, each column from where it left off
+        out.resize(header.count);
+        int64_t values[4] = {0, 0, 0, 0};
+        for (BattleEvent& event : out) {
+            for (size_t c = 0; c < 4; ++c) {
+                uint64_t delta;
+                if (!getVarint(columns[c], ends[c], delta)) throw corrupt(b);
+                values[c] += unzigzag(delta);
+            }
+            event.tick = uint32_t(values[0]);
+            event.attacker = uint32_t(values[1]);
+            event.target = uint32_t(values[2]);
+            event.damage = int32_t(values[3]);
+            event.outcome = *columns[4]++;
+        }
+    }
+
+    // The first block that can hold tick: the first one that doesn't end before it
+    size_t firstBlockOf(uint32_t tick) const {
+        return size_t(std::partition_point(index.begin(), index.end(),
+                                           [&](const EventBlockIndex& entry) { return entry.lastTick < tick; }) - index.begin());
+    }
+
+    // Every event of one tick, decoding only the blocks it spans
+    std::vector<BattleEvent> eventsAt(uint32_t tick) const {
+        std::vector<BattleEvent> found, block;
+        for (size_t b = firstBlockOf(tick); b < index.size() && index[b].firstTick <= tick; ++b) {
+            decode(b, block);
+            for (const BattleEvent& event : block) {
+                if (event.tick == tick) found.push_back(event);
+            }
+        }
+        return found;
+    }
+
+private:
+    std::runtime_error corrupt(size_t b) const {
+        return snapshotError(path, "block " + std::to_string(b) + " is corrupt");
+    }
+
+    void unmap() {
+        if (bytes) munmap(const_cast<uint8_t*>(bytes), size);
+        bytes = nullptr;
+    }
+
+    std::string path;
+    const uint8_t* bytes = nullptr;
+    uint64_t size = 0;
+    uint64_t indexOffset = 0;
+    uint64_t events = 0;
+    std::vector<EventBlockIndex> index;
+};
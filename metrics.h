@@ -0,0 +1,338 @@
+// Metrics for the pool and the battle: counters, gauges and HDR-style latency histograms, looked up
+// by name in one registry and dumped at the end of a run or sampled every so often from a
+// background thread. Build with -DBUGHUNT_METRICS=1 to turn them on. Otherwise every type below is
+// an empty stub, so the call sites (clock reads included) compile to nothing.
+//
+// Metrics are registered once and live until exit. Call sites keep a reference in a static local:
+//     static metrics::Histogram& attackNs = metrics::histogram("battle.attack_ns");
+// Counters and histograms are sharded by thread, each shard on its own cache lines, so recording is
+// a relaxed add on memory other threads rarely touch. Reads merge the shards.
+
+#pragma once
+
+#ifndef BUGHUNT_METRICS
+#define BUGHUNT_METRICS 0
+#endif
+
+#include <cstdint>
+#include <cstddef>
+#include <ostream>
+
+#if BUGHUNT_METRICS
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <condition_variable>
+#endif
+
+namespace metrics {
+
+#if BUGHUNT_METRICS
+
+constexpr bool kEnabled = true;
+
+inline uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Shard of the calling thread. Threads are numbered as they first record something, so with no more
+// threads than shards every thread has its shard to itself.
+constexpr size_t kShards = 16;
+
+inline size_t myShard() {
+    static std::atomic<size_t> nextThread{0};
+    thread_local size_t shard = nextThread.fetch_add(1, std::memory_order_relaxed) % kShards;
+    return shard;
+}
+
+// Monotonic count, eg attacks made
+class Counter {
+public:
+    void add(uint64_t n = 1) {
+        shards[myShard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const {
+        uint64_t sum = 0;
+        for (const Shard& shard : shards) sum += shard.value.load(std::memory_order_relaxed);
+        return sum;
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> value{0};
+    };
+    Shard shards[kShards];
+};
+
+// Last value set plus the highest value seen, eg soldiers still standing
+class Gauge {
+public:
+    void set(int64_t v) {
+        current.store(v, std::memory_order_relaxed);
+        int64_t seen = peak.load(std::memory_order_relaxed);
+        while (v > seen && !peak.compare_exchange_weak(seen, v, std::memory_order_relaxed)) {}
+        everSet.store(true, std::memory_order_relaxed);
+    }
+
+    int64_t value() const { return current.load(std::memory_order_relaxed); }
+    int64_t max() const { return peak.load(std::memory_order_relaxed); }
+    // False until the first set(), when max() means nothing yet
+    bool wasSet() const { return everSet.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> current{0};
+    std::atomic<int64_t> peak{INT64_MIN};
+    std::atomic<bool> everSet{false};
+};
+
+// Distribution of non-negative values (nanoseconds, queue depths) in log-linear buckets, as in
+// HdrHistogram: every power of two is split into 32 sub-buckets, so any value is recorded within
+// about 3% whether it is 50ns or 5s, in a fixed 1920 buckets and without allocating.
+class Histogram {
+public:
+    static constexpr int kSubBits = 5;
+    static constexpr size_t kSub = size_t(1) << kSubBits;
+    static constexpr size_t kBuckets = kSub + (64 - kSubBits) * kSub;
+
+    Histogram() {
+        for (auto& shard : shards) shard = std::make_unique<Shard>();
+    }
+
+    void record(uint64_t v) {
+        Shard& shard = *shards[myShard()];
+        shard.buckets[bucketOf(v)].fetch_add(1, std::memory_order_relaxed);
+        shard.sum.fetch_add(v, std::memory_order_relaxed);
+        uint64_t seen = shard.max.load(std::memory_order_relaxed);
+        while (v > seen && !shard.max.compare_exchange_weak(seen, v, std::memory_order_relaxed)) {}
+        seen = shard.min.load(std::memory_order_relaxed);
+        while (v < seen && !shard.min.compare_exchange_weak(seen, v, std::memory_order_relaxed)) {}
+    }
+
+    // Merged view of all shards
+    struct Snapshot {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t min = UINT64_MAX;
+        uint64_t max = 0;
+        std::unique_ptr<uint64_t[]> buckets = std::make_unique<uint64_t[]>(kBuckets);
+
+        double mean() const { return count ? double(sum) / count : 0.0; }
+
+        // Value at quantile q (0..1), reported as the top of its bucket and capped at the real max
+        uint64_t percentile(double q) const {
+            if (count == 0) return 0;
+            uint64_t rank = uint64_t(q * (count - 1)) + 1;
+            uint64_t seen = 0;
+            for (size_t b = 0; b < kBuckets; ++b) {
+                seen += buckets[b];
+                if (seen >= rank) return std::min(max, upperBound(b));
+            }
+            return max;
+        }
+    };
+
+    Snapshot snapshot() const {
+        Snapshot snap;
+        for (const auto& shard : shards) {
+            for (size_t b = 0; b < kBuckets; ++b) {
+                uint64_t n = shard->buckets[b].load(std::memory_order_relaxed);
+                snap.buckets[b] += n;
+                snap.count += n;
+            }
+            snap.sum += shard->sum.load(std::memory_order_relaxed);
+            snap.min = std::min(snap.min, shard->min.load(std::memory_order_relaxed));
+            snap.max = std::max(snap.max, shard->max.load(std::memory_order_relaxed));
+        }
+        return snap;
+    }
+
+    static size_t bucketOf(uint64_t v) {
+        if (v < kSub) return v;
+        int exp = 63 - __builtin_clzll(v);                                  // position of the top bit, >= kSubBits
+        size_t mantissa = (v >> (exp - kSubBits)) & (kSub - 1);             // the next kSubBits bits
+        return kSub + size_t(exp - kSubBits) * kSub + mantissa;
+    }
+
+    static uint64_t upperBound(size_t bucket) {
+        if (bucket < kSub) return bucket;
+        int exp = int((bucket - kSub) / kSub) + kSubBits;
+        uint64_t mantissa = (bucket - kSub) % kSub;
+        uint64_t width = uint64_t(1) << (exp - kSubBits);
+        return ((kSub + mantissa) << (exp - kSubBits)) + (width - 1);
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> buckets[kBuckets] = {};
+        std::atomic<uint64_t> sum{0};
+        std::atomic<uint64_t> min{UINT64_MAX};
+        std::atomic<uint64_t> max{0};
+    };
+
+    // Shards are allocated separately, 16 x 15KB would be a lot for a static local
+    std::unique_ptr<Shard> shards[kShards];
+};
+
+// Every metric by name, in registration order. Registering takes a lock, recording never does.
+class Registry {
+public:
+    static Registry& instance() {
+        static Registry registry;
+        return registry;
+    }
+
+    Counter& counter(const std::string& name) { return find(counters, name); }
+    Gauge& gauge(const std::string& name) { return find(gauges, name); }
+    Histogram& histogram(const std::string& name) { return find(histograms, name); }
+
+    void dump(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(mtx);
+        out << "\nMetrics:\n";
+        for (auto& [name, counter] : counters) {
+            out << "  " << std::left << std::setw(28) << name << std::right << " " << counter->value() << "\n";
+        }
+        for (auto& [name, gauge] : gauges) {
+            out << "  " << std::left << std::setw(28) << name << std::right << " ";
+            if (gauge->wasSet()) {
+                out << gauge->value() << " (max " << gauge->max() << ")\n";
+            } else {
+                out << "never set\n";
+            }
+        }
+        for (auto& [name, histogram] : histograms) {
+            Histogram::Snapshot snap = histogram->snapshot();
+            out << "  " << std::left << std::setw(28) << name << std::right << " n=" << snap.count;
+            if (snap.count > 0) {
+                out << " min=" << snap.min << " p50=" << snap.percentile(0.5) << " p90=" << snap.percentile(0.9)
+                    << " p99=" << snap.percentile(0.99) << " max=" << snap.max
+                    << " mean=" << std::fixed << std::setprecision(1) << snap.mean() << std::defaultfloat;
+            }
+            out << "\n";
+        }
+    }
+
+private:
+    template<typename Metric>
+    using Named = std::deque<std::pair<std::string, std::unique_ptr<Metric>>>;
+
+    template<typename Metric>
+    Metric& find(Named<Metric>& metrics, const std::string& name) {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto& [existing, metric] : metrics) {
+            if (existing == name) return *metric;
+        }
+        return *metrics.emplace_back(name, std::make_unique<Metric>()).second;
+    }
+
+    std::mutex mtx;
+    Named<Counter> counters;
+    Named<Gauge> gauges;
+    Named<Histogram> histograms;
+};
+
+// Dumps the registry every interval until destroyed, for watching a long battle as it runs
+class Sampler {
+public:
+    Sampler(std::ostream& out, std::chrono::milliseconds interval) : thread([this, &out, interval]() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (!cv.wait_for(lock, interval, [this]() { return stopping; })) {
+            Registry::instance().dump(out);
+        }
+    }) {}
+
+    ~Sampler() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        thread.join();
+    }
+
+private:
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::thread thread;     // last, so it starts after the members it uses
+};
+
+#else
+
+// Metrics off: same interface, no state, no clock reads
+
+constexpr bool kEnabled = false;
+
+inline uint64_t nowNs() { return 0; }
+
+class Counter {
+public:
+    void add(uint64_t = 1) {}
+    uint64_t value() const { return 0; }
+};
+
+class Gauge {
+public:
+    void set(int64_t) {}
+    int64_t value() const { return 0; }
+    int64_t max() const { return 0; }
+    bool wasSet() const { return false; }
+};
+
+class Histogram {
+public:
+    void record(uint64_t) {}
+};
+
+class Registry {
+public:
+    static Registry& instance() {
+        static Registry registry;
+        return registry;
+    }
+
+    Counter& counter(const char*) { return counterStub; }
+    Gauge& gauge(const char*) { return gaugeStub; }
+    Histogram& histogram(const char*) { return histogramStub; }
+    void dump(std::ostream&) {}
+
+private:
+    Counter counterStub;
+    Gauge gaugeStub;
+    Histogram histogramStub;
+};
+
+class Sampler {
+public:
+    template<typename Interval>
+    Sampler(std::ostream&, Interval) {}
+};
+
+#endif
+
+inline Counter& counter(const char* name) { return Registry::instance().counter(name); }
+inline Gauge& gauge(const char* name) { return Registry::instance().gauge(name); }
+inline Histogram& histogram(const char* name) { return Registry::instance().histogram(name); }
+inline void dump(std::ostream& out) { Registry::instance().dump(out); }
+
+// Records the time from construction to destruction into a histogram, in nanoseconds
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Histogram& histogram) : histogram(histogram), start(nowNs()) {}
+    ~ScopedTimer() {
+        if constexpr (kEnabled) histogram.record(nowNs() - start);
+    }
+
+private:
+    Histogram& histogram;
+    uint64_t start;
+};
+
+} // namespace metrics
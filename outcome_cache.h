@@ -0,0 +1,169 @@
+// Sweep results kept on disk, so asking about the same matchup again costs nothing and asking for
+// more precision only fights the battles that are missing.
+// An entry is found by an OutcomeKey: a hash of everything the result depends on. That covers the
+// engine version, the unit types, the forces and their opening state, the waves, who goes first,
+// the turn limit, antithetic runs, and the random stream family the battles come from. Battle
+// streams are numbered (BattleRng::keyed), so an entry records how many samples it holds. Topping it
+// up fights samples from that number on, and the result is the same as one longer sweep.
+//     OutcomeCache cache("sweeps.cache");
+//     CachedSweep entry = cache.lookup(key, 0, streamKey, paired);
+//     ... fight samples entry.samples, entry.samples + 1, ... into entry.stats ...
+//     cache.store(entry);
+//     cache.save();
+// The file is a header and an array of CachedSweep records, rewritten whole through FILE.tmp and a
+// rename, like a checkpoint. Two sweeps saving at once don't corrupt it, but the last one wins.
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "battle_state.h"
+#include "sweep_stats.h"
+
+// 64-bit hash built up from the bytes of plain records, a word at a time
+class OutcomeKey {
+public:
+    OutcomeKey& add(const void* data, size_t bytes) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        for (; bytes >= 8; p += 8, bytes -= 8) {
+            uint64_t word;
+            std::memcpy(&word, p, 8);
+            mix(word);
+        }
+        uint64_t tail = 0;
+        std::memcpy(&tail, p, bytes);
+        mix(tail ^ (uint64_t(bytes) << 56));
+        return *this;
+    }
+
+    template<typename T>
+    OutcomeKey& add(const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        return add(&value, sizeof(value));
+    }
+
+    template<typename T>
+    OutcomeKey& add(const std::vector<T>& items) {
+        add(uint64_t(items.size()));
+        return add(items.data(), items.size() * sizeof(T));
+    }
+
+    template<typename T>
+    OutcomeKey& add(const MappedArray<T>& items) {
+        add(uint64_t(items.size()));
+        return add(items.data(), items.size() * sizeof(T));
+    }
+
+    // Never 0, which CachedSweep uses for "no baseline"
+    uint64_t value() const { return hash ? hash : 1; }
+
+private:
+    void mix(uint64_t word) {
+        hash = (hash ^ word) * 0x100000001B3ull;
+        hash ^= hash >> 29;
+    }
+
+    uint64_t hash = 0xCBF29CE484222325ull;
+};
+
+// The opening state of a battle, as far as its outcome goes
+inline OutcomeKey& addBattle(OutcomeKey& key, const BattleState& state) {
+    key.add(state.types).add(state.marineGroups).add(state.bugGroups).add(state.marines).add(state.bugs)
+       .add(state.reinforcements).add(state.turn).add(uint32_t(state.marineTurn));
+    return key;
+}
+
+struct CachedSweep {
+    uint64_t key;
+    uint64_t baselineKey;       // with common random numbers, the configuration the differences are from; 0 if none
+    uint64_t streamKey;         // battles are streams 0 .. samples - 1 of this family
+    uint64_t samples;           // one battle each, or an antithetic pair
+    SweepStats stats;
+    SweepDifference difference;
+};
+static_assert(std::is_trivially_copyable_v<CachedSweep>);
+
+constexpr char kCacheMagic[8] = {'B', 'H', 'C', 'A', 'C', 'H', 'E', '\n'};
+constexpr uint32_t kCacheVersion = 1;
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;        // catches a record layout change that forgot to bump the version
+    uint64_t count;
+};
+
+class OutcomeCache {
+public:
+    // Reads path if it exists. A file of another version is ignored and replaced on save.
+    explicit OutcomeCache(std::string path) : path(std::move(path)) {
+        FileHandle file(::open(this->path.c_str(), O_RDONLY));
+        if (file.fd < 0) {
+            if (errno == ENOENT) return;
+            throw snapshotError(this->path, std::strerror(errno));
+        }
+        CacheHeader header;
+        if (pread(file.fd, &header, sizeof(header), 0) != ssize_t(sizeof(header))
+            || std::memcmp(header.magic, kCacheMagic, sizeof(header.magic)) != 0) {
+            throw snapshotError(this->path, "not an outcome cache");
+        }
+        if (header.version != kCacheVersion || header.recordSize != sizeof(CachedSweep)) return;
+        entries = readSection<CachedSweep>(file.fd, {sizeof(header), header.count}, this->path);
+    }
+
+    // A copy of the entry for key, or an empty one with no samples
+    CachedSweep lookup(uint64_t key, uint64_t baselineKey, uint64_t streamKey, bool paired) const {
+        for (const CachedSweep& cached : entries) {
+            if (cached.key == key && cached.baselineKey == baselineKey) return cached;
+        }
+        CachedSweep fresh{};
+        fresh.key = key;
+        fresh.baselineKey = baselineKey;
+        fresh.streamKey = streamKey;
+        fresh.stats.paired = paired;
+        return fresh;
+    }
+
+    void store(const CachedSweep& entry) {
+        for (CachedSweep& cached : entries) {
+            if (cached.key == entry.key && cached.baselineKey == entry.baselineKey) {
+                cached = entry;
+                return;
+            }
+        }
+        entries.push_back(entry);
+    }
+
+    void save() const {
+        CacheHeader header{};
+        std::memcpy(header.magic, kCacheMagic, sizeof(header.magic));
+        header.version = kCacheVersion;
+        header.recordSize = sizeof(CachedSweep);
+        header.count = entries.size();
+
+        std::string tmp = path + ".tmp";
+        FileHandle file(::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+        if (file.fd < 0) throw snapshotError(tmp, std::strerror(errno));
+        ssize_t bytes = ssize_t(entries.size() * sizeof(CachedSweep));
+        if (write(file.fd, &header, sizeof(header)) != ssize_t(sizeof(header))
+            || (bytes && write(file.fd, entries.data(), size_t(bytes)) != bytes) || fsync(file.fd) != 0) {
+            throw snapshotError(tmp, std::strerror(errno));
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) throw snapshotError(path, std::strerror(errno));
+    }
+
+private:
+    std::string path;
+    std::vector<CachedSweep> entries;
+};
@@ -0,0 +1,274 @@
+// Hardware performance counters per battle phase, read with Linux perf_event_open.
+// For each phase (attack, damage apply, stats, ...) we add up cycles, instructions, cache misses and
+// branch misses, and from those work out IPC and misses per thousand instructions. That's what a
+// change to the Soldier/Marine/Bug layout or to virtual dispatch should be judged by, not just
+// attacks per second.
+//
+// Off unless PerfPhases::instance().enable() is called (the engines do that for --perf). Every
+// thread opens its own counter group the first time it enters a phase, and counts only itself, in
+// user space. Each PerfScope reads the group when it starts and when it ends, one syscall each,
+// so scopes should wrap a chunk of work (a tick phase, 64 attacks) and not a single attack.
+// Without a PMU (most VMs and containers) the hardware counters can't be opened. Phases then
+// still get their call counts and times, and the report says why the counters are missing.
+// A scope whose reads fail adds no counts. When the PMU has more groups than it can run at once it
+// multiplexes them; a scope's counts are then scaled up by how long the group was enabled over how
+// long it actually ran, and the report says how many calls were scaled.
+
+#pragma once
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// What one phase cost
+struct PerfCounts {
+    uint64_t calls = 0;
+    uint64_t ns = 0;
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t cacheMisses = 0;
+    uint64_t branchMisses = 0;
+    uint64_t counted = 0;       // calls the hardware counts came from; the others' reads failed
+    uint64_t scaled = 0;        // of those, calls whose counts were scaled up for multiplexing
+
+    PerfCounts& operator+=(const PerfCounts& other) {
+        calls += other.calls;
+        ns += other.ns;
+        counted += other.counted;
+        scaled += other.scaled;
+        cycles += other.cycles;
+        instructions += other.instructions;
+        cacheMisses += other.cacheMisses;
+        branchMisses += other.branchMisses;
+        return *this;
+    }
+};
+
+// The calling thread's group of four hardware counters, led by cycles so all four are
+// scheduled onto the PMU together and can be read with one read()
+class PerfGroup {
+public:
+    static constexpr int kEvents = 4;
+
+    // All four counters at one moment, with how long (ns) the group has been enabled and how long
+    // it has actually been on the PMU. The two differ when the kernel multiplexes groups.
+    struct Reading {
+        uint64_t values[kEvents] = {};
+        uint64_t enabled = 0;
+        uint64_t running = 0;
+    };
+
+    // Returns 0, or the errno of the first counter that wouldn't open
+    int open() {
+        static constexpr uint64_t configs[kEvents] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+        };
+        for (int i = 0; i < kEvents; ++i) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            attr.exclude_kernel = 1;    // user space only, allowed at perf_event_paranoid 2
+            attr.exclude_hv = 1;
+            attr.disabled = i == 0;     // the group starts when its leader is enabled
+            int fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], 0));
+            if (fd < 0) {
+                int error = errno;
+                close();
+                return error;
+            }
+            fds[i] = fd;
+        }
+        ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        return 0;
+    }
+
+    bool isOpen() const { return fds[0] >= 0; }
+
+    // Current totals of all four counters, false if the read failed
+    bool read(Reading& reading) const {
+        struct {
+            uint64_t count;
+            uint64_t enabled;
+            uint64_t running;
+            uint64_t values[kEvents];
+        } data;
+        if (::read(fds[0], &data, sizeof(data)) != ssize_t(sizeof(data)) || data.count != kEvents) return false;
+        std::memcpy(reading.values, data.values, sizeof(data.values));
+        reading.enabled = data.enabled;
+        reading.running = data.running;
+        return true;
+    }
+
+    ~PerfGroup() { close(); }
+
+private:
+    void close() {
+        for (int& fd : fds) {
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+        }
+    }
+
+    int fds[kEvents] = {-1, -1, -1, -1};
+};
+
+// Every phase's totals, summed over all threads at report time
+class PerfPhases {
+public:
+    static PerfPhases& instance() {
+        static PerfPhases phases;
+        return phases;
+    }
+
+    // Turn counting on. Tries the counters on the calling thread so the report can say up front
+    // whether hardware counts will be there. Returns false if they won't be (timing still works).
+    bool enable() {
+        on.store(true, std::memory_order_relaxed);
+        return mine().group.isOpen();
+    }
+
+    bool enabled() const { return on.load(std::memory_order_relaxed); }
+
+    // Index for a phase name, registering it the first time. Call sites keep it in a static local.
+    size_t phase(const char* name) {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (names[i] == name) return i;
+        }
+        names.push_back(name);
+        return names.size() - 1;
+    }
+
+    // The calling thread's counters and totals, opened and registered on first use
+    struct ThreadState {
+        PerfGroup group;
+        std::vector<PerfCounts> totals;
+    };
+
+    ThreadState& mine() {
+        thread_local ThreadState* state = nullptr;
+        if (!state) {
+            auto fresh = std::make_unique<ThreadState>();
+            int error = fresh->group.open();
+            std::lock_guard<std::mutex> lock(mtx);
+            if (error != 0 && openError == 0) openError = error;
+            threads.push_back(std::move(fresh));
+            state = threads.back().get();
+        }
+        return *state;
+    }
+
+    PerfCounts total(size_t phase) {
+        std::lock_guard<std::mutex> lock(mtx);
+        PerfCounts sum;
+        for (const auto& thread : threads) {
+            if (phase < thread->totals.size()) sum += thread->totals[phase];
+        }
+        return sum;
+    }
+
+    // One line per phase. label says which engine variant the numbers belong to.
+    void report(std::ostream& out, const std::string& label) {
+        if (!enabled()) return;
+        std::vector<std::string> phaseNames;
+        int error;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            phaseNames = names;
+            error = openError;
+        }
+
+        out << "\nPerf counters, " << label << ":\n";
+        if (error != 0) {
+            out << "  (hardware counters unavailable: " << std::strerror(error) << ", showing calls and time only)\n";
+        }
+        for (size_t p = 0; p < phaseNames.size(); ++p) {
+            PerfCounts c = total(p);
+            out << "  " << std::left << std::setw(14) << phaseNames[p] << std::right
+                << std::setw(10) << c.calls << " calls " << std::setw(10) << std::fixed << std::setprecision(3)
+                << c.ns / 1e6 << " ms";
+            if (error == 0 && c.instructions > 0) {
+                double kilo = c.instructions / 1000.0;
+                out << std::setw(14) << c.cycles << " cycles " << std::setw(14) << c.instructions << " instr"
+                    << "  IPC " << std::setprecision(2) << double(c.instructions) / std::max<uint64_t>(1, c.cycles)
+                    << "  cache-miss/kinstr " << c.cacheMisses / kilo
+                    << "  branch-miss/kinstr " << c.branchMisses / kilo;
+                if (c.counted < c.calls) out << "  (counts from " << c.counted << " of the calls)";
+                if (c.scaled > 0) out << "  (" << c.scaled << " calls scaled, counters multiplexed)";
+            }
+            out << std::defaultfloat << "\n";
+        }
+    }
+
+private:
+    std::atomic<bool> on{false};
+    std::mutex mtx;
+    std::vector<std::string> names;
+    std::deque<std::unique_ptr<ThreadState>> threads;
+    int openError = 0;
+};
+
+// Counts the enclosed code into a phase. Does nothing (one relaxed load) unless enabled.
+class PerfScope {
+public:
+    explicit PerfScope(size_t phase) : phase(phase) {
+        PerfPhases& phases = PerfPhases::instance();
+        if (!phases.enabled()) return;
+        state = &phases.mine();
+        haveBefore = state->group.isOpen() && state->group.read(before);
+        start = std::chrono::steady_clock::now();
+    }
+
+    ~PerfScope() {
+        if (!state) return;
+        auto end = std::chrono::steady_clock::now();
+        PerfGroup::Reading after;
+        bool haveAfter = haveBefore && state->group.read(after);
+
+        if (state->totals.size() <= phase) state->totals.resize(phase + 1);
+        PerfCounts& counts = state->totals[phase];
+        ++counts.calls;
+        counts.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        // No counts if a read failed, or if the group never got onto the PMU during the scope
+        if (!haveAfter || after.running == before.running) return;
+        uint64_t running = after.running - before.running;
+        uint64_t enabled = after.enabled - before.enabled;
+        double scale = enabled > running ? double(enabled) / double(running) : 1.0;
+        auto delta = [&](int event) { return uint64_t(double(after.values[event] - before.values[event]) * scale); };
+        ++counts.counted;
+        if (scale > 1.0) ++counts.scaled;
+        counts.cycles += delta(0);
+        counts.instructions += delta(1);
+        counts.cacheMisses += delta(2);
+        counts.branchMisses += delta(3);
+    }
+
+    PerfScope(const PerfScope&) = delete;
+    PerfScope& operator=(const PerfScope&) = delete;
+
+private:
+    size_t phase;
+    PerfPhases::ThreadState* state = nullptr;
+    PerfGroup::Reading before;
+    bool haveBefore = false;
+    std::chrono::steady_clock::time_point start;
+};
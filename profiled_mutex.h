@@ -0,0 +1,91 @@
+// A mutex that reports how it is used, to find the lock that caps scaling. Drop-in for std::mutex
+// (lock, try_lock, unlock), named at construction:
+//     ProfiledMutex mtx{"pool"};
+// With -DBUGHUNT_METRICS=1 every lock gets four metrics, printed with the rest by metrics::dump():
+//     lock.<name>.acquired    times it was taken
+//     lock.<name>.contended   times the taker found it held and had to block
+//     lock.<name>.wait_ns     time from asking for the lock to getting it (0 when uncontended)
+//     lock.<name>.hold_ns     time from getting it to releasing it
+// Without metrics it is a plain std::mutex plus an untaken branch. Either way a contended lock()
+// shows up as a "lock wait" span when tracing (trace.h).
+//
+// std::condition_variable only takes std::unique_lock<std::mutex>, so wait on one of these with
+// std::condition_variable_any. Its wait() calls our unlock() and lock(), so time spent waiting
+// for the condition is not counted as hold time.
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "metrics.h"
+#include "trace.h"
+
+class ProfiledMutex {
+public:
+    explicit ProfiledMutex(const char* name) : profile(name) {}
+
+    ProfiledMutex(const ProfiledMutex&) = delete;
+    ProfiledMutex& operator=(const ProfiledMutex&) = delete;
+
+    void lock() {
+        // Only the slow path pays for a clock read and a span
+        if (mtx.try_lock()) {
+            profile.acquired(false, 0);
+        } else {
+            trace::Span span("lock wait", "lock");
+            uint64_t start = metrics::nowNs();
+            mtx.lock();
+            profile.acquired(true, metrics::nowNs() - start);
+        }
+        heldSince = metrics::nowNs();
+    }
+
+    bool try_lock() {
+        if (!mtx.try_lock()) return false;
+        profile.acquired(false, 0);
+        heldSince = metrics::nowNs();
+        return true;
+    }
+
+    void unlock() {
+        uint64_t held = metrics::nowNs() - heldSince;
+        mtx.unlock();
+        profile.released(held);
+    }
+
+private:
+#if BUGHUNT_METRICS
+    struct Profile {
+        explicit Profile(const char* name) :
+            acquisitions(metrics::counter(("lock." + std::string(name) + ".acquired").c_str())),
+            contentions(metrics::counter(("lock." + std::string(name) + ".contended").c_str())),
+            waitNs(metrics::histogram(("lock." + std::string(name) + ".wait_ns").c_str())),
+            holdNs(metrics::histogram(("lock." + std::string(name) + ".hold_ns").c_str())) {}
+
+        void acquired(bool contended, uint64_t waited) {
+            acquisitions.add();
+            if (contended) contentions.add();
+            waitNs.record(waited);
+        }
+
+        void released(uint64_t held) { holdNs.record(held); }
+
+        metrics::Counter& acquisitions;
+        metrics::Counter& contentions;
+        metrics::Histogram& waitNs;
+        metrics::Histogram& holdNs;
+    };
+#else
+    struct Profile {
+        explicit Profile(const char*) {}
+        void acquired(bool, uint64_t) {}
+        void released(uint64_t) {}
+    };
+#endif
+
+    std::mutex mtx;
+    uint64_t heldSince = 0;     // only touched by the holder
+    [[no_unique_address]] Profile profile;
+};
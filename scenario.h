@@ -0,0 +1,301 @@
+// Battle scenarios for the turns engine: unit types, forces, and soldiers that start out hurt or
+// dead, in a binary file that soldier_w_turns --scenario=FILE maps and reads in place.
+// scenario_convert.cpp writes it from a text description like this one:
+//     # A million Marines hold the ridge
+//     unit Warrior health=150 accuracy=8 damage=60 save=50 piercing
+//     marines 1000000 Marine
+//     bugs 3000000 Bug
+//     bugs 500 Warrior
+//     first bugs
+//     seed 42
+//     set bugs 17 wounds=50 save-used
+//     set marines 3 dead
+//     wave 10 bugs 250000 Warrior
+// Types come from a UnitRegistry (unit_types.h): Marine, Bug and any table loaded into it. A unit
+// line with the name of a known type redefines it. Stats a unit line leaves out are a Marine's.
+// save=N gives the one-time save that heals N, piercing makes crits ignore saves. Each marines/bugs
+// line adds a group of that many soldiers of one type to the force, in order. set lines override
+// single soldiers. A wave line brings reinforcements of one type into a force at the start of a
+// turn (see reinforce() in battle_state.h).
+//
+// Binary layout: [ScenarioHeader][unit types][marine groups][bug groups][overrides][waves]
+// There is no per-soldier data unless a soldier is overridden. Fresh soldiers are zero bytes, so the
+// soldier arrays are new anonymous mappings and startup costs the same for ten soldiers as for ten
+// million. Only the overrides are copied in.
+
+#pragma once
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "battle_state.h"
+#include "unit_types.h"
+
+constexpr char kScenarioMagic[8] = {'B', 'H', 'S', 'C', 'E', 'N', '\r', '\n'};
+constexpr uint32_t kScenarioVersion = 2;
+
+struct ScenarioHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t unitTypeSize;      // catches a record layout change that forgot to bump the version
+    uint64_t seed;              // 0: seed from the clock
+    uint32_t marinesFirst;
+    uint32_t reserved;
+    FileSection types;
+    FileSection marineGroups;
+    FileSection bugGroups;
+    FileSection overrides;
+    FileSection reinforcements;
+};
+
+// Starting record for one soldier
+struct UnitOverride {
+    uint32_t bugs;              // 1 if index is in the bug force
+    uint32_t reserved;
+    uint64_t index;
+    Combatant soldier;
+};
+static_assert(std::is_trivially_copyable_v<UnitOverride>);
+
+struct Scenario {
+    std::vector<UnitType> types = defaultUnitTypes();
+    std::vector<ForceGroup> marineGroups;
+    std::vector<ForceGroup> bugGroups;
+    std::vector<UnitOverride> overrides;
+    std::vector<Reinforcement> reinforcements;  // by turn
+    uint64_t seed = 0;
+    bool marinesFirst = true;
+};
+
+inline Scenario parseScenario(std::istream& in, const std::string& name, const UnitRegistry& registry = UnitRegistry()) {
+    Scenario scenario;
+    UnitRegistry units = registry;
+    std::string line;
+    int lineNumber = 0;
+    auto fail = [&](const std::string& what) { return std::runtime_error(name + ":" + std::to_string(lineNumber) + ": " + what); };
+    auto typeIndex = [&](const std::string& type) {
+        const UnitType* found = units.find(type);
+        if (!found) throw fail("unknown unit type " + type);
+        return uint32_t(found - units.all().data());
+    };
+    // key=value, or a bare flag
+    auto split = [](const std::string& field) {
+        size_t eq = field.find('=');
+        return std::pair(field.substr(0, eq), eq == std::string::npos ? std::string() : field.substr(eq + 1));
+    };
+    auto number = [&](const std::string& key, const std::string& text) {
+        try {
+            size_t used;
+            long long value = std::stoll(text, &used);
+            if (used != text.size() || value < 0) throw std::invalid_argument(text);
+            return value;
+        } catch (const std::exception&) {
+            throw fail(key + " needs a whole number, not '" + text + "'");
+        }
+    };
+
+    while (std::getline(in, line)) {
+        ++lineNumber;
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        std::string command;
+        if (!(fields >> command)) continue;
+
+        if (command == "unit") {
+            std::string typeName;
+            if (!(fields >> typeName)) throw fail("unit needs a name");
+            if (typeName.size() >= sizeof(UnitType::name)) throw fail("unit names are at most 15 characters");
+            UnitType type = makeUnitType(typeName, 100, 7, 50, 10, 0, 0);
+            for (std::string field; fields >> field;) {
+                auto [key, value] = split(field);
+                if (key == "health") type.maxHealth = int32_t(number(key, value));
+                else if (key == "accuracy") type.accuracy = int32_t(number(key, value));
+                else if (key == "damage") type.damage = int32_t(number(key, value));
+                else if (key == "crit") type.critRoll = int32_t(number(key, value));
+                else if (key == "save") {
+                    type.saveHeal = int32_t(number(key, value));
+                    type.rules |= kOneTimeSave;
+                }
+                else if (key == "piercing") type.rules |= kPiercingCrit;
+                else throw fail("unknown unit stat " + key);
+            }
+            std::string problem = unitTypeProblem(type);
+            if (!problem.empty()) throw fail(problem);
+            units.add(type);    // redefining a type keeps its index, so earlier groups stay valid
+        } else if (command == "marines" || command == "bugs") {
+            std::string count, typeName;
+            if (!(fields >> count >> typeName)) throw fail(command + " needs a count and a unit type");
+            std::vector<ForceGroup>& groups = command == "marines" ? scenario.marineGroups : scenario.bugGroups;
+            uint64_t begin = groups.empty() ? 0 : groups.back().end;
+            uint64_t n = uint64_t(number("count", count));
+            if (n == 0) throw fail("a group needs at least one soldier");
+            if (begin + n > UINT32_MAX) throw fail("a force can have at most " + std::to_string(UINT32_MAX) + " soldiers");
+            groups.push_back({typeIndex(typeName), 0, begin, begin + n});
+        } else if (command == "first") {
+            std::string side;
+            fields >> side;
+            if (side != "marines" && side != "bugs") throw fail("first is marines or bugs");
+            scenario.marinesFirst = side == "marines";
+        } else if (command == "seed") {
+            std::string seed;
+            fields >> seed;
+            scenario.seed = uint64_t(number("seed", seed));
+        } else if (command == "set") {
+            std::string side, index;
+            if (!(fields >> side >> index) || (side != "marines" && side != "bugs")) {
+                throw fail("set needs marines or bugs and a soldier number");
+            }
+            UnitOverride unit{};
+            unit.bugs = side == "bugs";
+            unit.index = uint64_t(number("soldier number", index));
+            for (std::string field; fields >> field;) {
+                auto [key, value] = split(field);
+                if (key == "wounds") unit.soldier.wounds = int32_t(number(key, value));
+                else if (key == "hits") unit.soldier.hits = uint32_t(number(key, value));
+                else if (key == "kills") unit.soldier.kills = uint32_t(number(key, value));
+                else if (key == "dead") unit.soldier.dead = 1;
+                else if (key == "save-used") unit.soldier.saveUsed = 1;
+                else throw fail("unknown soldier field " + key);
+            }
+            scenario.overrides.push_back(unit);
+        } else if (command == "wave") {
+            std::string turn, side, count, typeName;
+            if (!(fields >> turn >> side >> count >> typeName) || (side != "marines" && side != "bugs")) {
+                throw fail("wave needs a turn, marines or bugs, a count and a unit type");
+            }
+            Reinforcement wave{};
+            long long when = number("turn", turn);
+            if (when < 1 || when > UINT32_MAX) throw fail("a wave's turn is from 1 to " + std::to_string(UINT32_MAX));
+            wave.turn = uint32_t(when);
+            wave.bugs = side == "bugs";
+            wave.type = typeIndex(typeName);
+            wave.count = uint64_t(number("count", count));
+            if (wave.count == 0 || wave.count > UINT32_MAX) throw fail("a wave brings 1 to " + std::to_string(UINT32_MAX) + " soldiers");
+            scenario.reinforcements.push_back(wave);
+        } else {
+            throw fail("unknown command " + command);
+        }
+    }
+
+    scenario.types = units.all();
+    std::stable_sort(scenario.reinforcements.begin(), scenario.reinforcements.end(),
+                     [](const Reinforcement& a, const Reinforcement& b) { return a.turn < b.turn; });
+    if (scenario.marineGroups.empty() || scenario.bugGroups.empty()) {
+        throw std::runtime_error(name + ": needs at least one marines line and one bugs line");
+    }
+    for (const UnitOverride& unit : scenario.overrides) {
+        const std::vector<ForceGroup>& groups = unit.bugs ? scenario.bugGroups : scenario.marineGroups;
+        if (unit.index >= groups.back().end) {
+            throw std::runtime_error(name + ": set " + (unit.bugs ? "bugs " : "marines ") + std::to_string(unit.index)
+                                     + " is past the end of the force");
+        }
+    }
+    return scenario;
+}
+
+inline void writeScenario(const Scenario& scenario, const std::string& path) {
+    // Sections only need to be aligned for their records, there's nothing big to map
+    auto after = [](const FileSection& previous, size_t itemSize, size_t count) {
+        return FileSection{(previous.offset + previous.count * itemSize + 63) / 64 * 64, count};
+    };
+
+    ScenarioHeader header{};
+    std::memcpy(header.magic, kScenarioMagic, sizeof(header.magic));
+    header.version = kScenarioVersion;
+    header.unitTypeSize = sizeof(UnitType);
+    header.seed = scenario.seed;
+    header.marinesFirst = scenario.marinesFirst;
+    header.types = {(sizeof(header) + 63) / 64 * 64, scenario.types.size()};
+    header.marineGroups = after(header.types, sizeof(UnitType), scenario.marineGroups.size());
+    header.bugGroups = after(header.marineGroups, sizeof(ForceGroup), scenario.bugGroups.size());
+    header.overrides = after(header.bugGroups, sizeof(ForceGroup), scenario.overrides.size());
+    header.reinforcements = after(header.overrides, sizeof(UnitOverride), scenario.reinforcements.size());
+
+    FileHandle file(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    if (file.fd < 0) throw snapshotError(path, std::strerror(errno));
+    auto put = [&](const void* data, size_t bytes, uint64_t offset) {
+        if (bytes && pwrite(file.fd, data, bytes, off_t(offset)) != ssize_t(bytes)) throw snapshotError(path, std::strerror(errno));
+    };
+    put(&header, sizeof(header), 0);
+    put(scenario.types.data(), scenario.types.size() * sizeof(UnitType), header.types.offset);
+    put(scenario.marineGroups.data(), scenario.marineGroups.size() * sizeof(ForceGroup), header.marineGroups.offset);
+    put(scenario.bugGroups.data(), scenario.bugGroups.size() * sizeof(ForceGroup), header.bugGroups.offset);
+    put(scenario.overrides.data(), scenario.overrides.size() * sizeof(UnitOverride), header.overrides.offset);
+    put(scenario.reinforcements.data(), scenario.reinforcements.size() * sizeof(Reinforcement), header.reinforcements.offset);
+    // Empty trailing sections still have to lie inside the file
+    uint64_t size = header.reinforcements.offset + scenario.reinforcements.size() * sizeof(Reinforcement);
+    if (ftruncate(file.fd, off_t(size)) != 0) throw snapshotError(path, std::strerror(errno));
+}
+
+template<typename T>
+std::vector<T> recordsAt(const char* base, const FileSection& section) {
+    const T* first = reinterpret_cast<const T*>(base + section.offset);
+    return std::vector<T>(first, first + section.count);
+}
+
+// Builds the opening state of a battle from a binary scenario. fallbackSeed is used if the scenario
+// doesn't fix one.
+inline BattleState loadScenario(const std::string& path, uint64_t fallbackSeed) {
+    FileHandle file(::open(path.c_str(), O_RDONLY));
+    if (file.fd < 0) throw snapshotError(path, std::strerror(errno));
+    struct stat info;
+    if (fstat(file.fd, &info) != 0) throw snapshotError(path, std::strerror(errno));
+    uint64_t size = uint64_t(info.st_size);
+    if (size < sizeof(ScenarioHeader)) throw snapshotError(path, "too short to be a scenario");
+
+    struct Mapping {
+        void* p;
+        size_t size;
+        ~Mapping() { if (p != MAP_FAILED) munmap(p, size); }
+    } mapping{mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file.fd, 0), size};
+    if (mapping.p == MAP_FAILED) throw snapshotError(path, std::strerror(errno));
+    const char* base = static_cast<const char*>(mapping.p);
+
+    const ScenarioHeader& header = *reinterpret_cast<const ScenarioHeader*>(base);
+    if (std::memcmp(header.magic, kScenarioMagic, sizeof(header.magic)) != 0) throw snapshotError(path, "not a scenario");
+    if (header.version != kScenarioVersion || header.unitTypeSize != sizeof(UnitType)) {
+        throw snapshotError(path, "scenario version " + std::to_string(header.version) + ", this build reads version "
+                                  + std::to_string(kScenarioVersion));
+    }
+    auto fits = [size](const FileSection& section, size_t itemSize) {
+        return section.offset % 64 == 0 && section.offset <= size && section.count <= (size - section.offset) / itemSize;
+    };
+    if (!fits(header.types, sizeof(UnitType)) || !fits(header.marineGroups, sizeof(ForceGroup))
+        || !fits(header.bugGroups, sizeof(ForceGroup)) || !fits(header.overrides, sizeof(UnitOverride))
+        || !fits(header.reinforcements, sizeof(Reinforcement))) {
+        throw snapshotError(path, "truncated scenario");
+    }
+    BattleState state;
+    state.types = recordsAt<UnitType>(base, header.types);
+    state.marineGroups = recordsAt<ForceGroup>(base, header.marineGroups);
+    state.bugGroups = recordsAt<ForceGroup>(base, header.bugGroups);
+    state.reinforcements = recordsAt<Reinforcement>(base, header.reinforcements);
+    uint64_t marineCount = state.marineGroups.empty() ? 0 : state.marineGroups.back().end;
+    uint64_t bugCount = state.bugGroups.empty() ? 0 : state.bugGroups.back().end;
+    std::string problem = checkGroups(state.marineGroups, marineCount, state.types.size());
+    if (problem.empty()) problem = checkGroups(state.bugGroups, bugCount, state.types.size());
+    if (problem.empty()) problem = checkReinforcements(state.reinforcements, state.types.size());
+    if (!problem.empty()) throw snapshotError(path, problem);
+
+    state.marines = MappedArray<Combatant>(marineCount);
+    state.bugs = MappedArray<Combatant>(bugCount);
+    const UnitOverride* overrides = reinterpret_cast<const UnitOverride*>(base + header.overrides.offset);
+    for (uint64_t i = 0; i < header.overrides.count; ++i) {
+        const UnitOverride& unit = overrides[i];
+        MappedArray<Combatant>& force = unit.bugs ? state.bugs : state.marines;
+        if (unit.index >= force.size()) throw snapshotError(path, "an override is past the end of its force");
+        force[unit.index] = unit.soldier;
+    }
+
+    state.rng.state = header.seed ? header.seed : fallbackSeed;
+    state.marineTurn = header.marinesFirst != 0;
+    return state;
+}
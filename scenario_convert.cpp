@@ -0,0 +1,51 @@
+// Turns a text battle scenario into the binary form that soldier_w_turns --scenario=FILE maps at startup.
+//     scenario_convert [--units=units.txt] ridge.txt ridge.scn
+// The text format is described in scenario.h, the unit table in unit_types.h.
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "scenario.h"
+#include "unit_types.h"
+
+int main(int argc, char* argv[]) {
+    std::string unitsPath;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--units=", 0) == 0) {
+            unitsPath = arg.substr(8);
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.size() != 2) {
+        std::cerr << "usage: " << argv[0] << " [--units=UNITS.txt] SCENARIO.txt SCENARIO.scn\n";
+        return 2;
+    }
+
+    try {
+        UnitRegistry registry;
+        if (!unitsPath.empty()) {
+            std::ifstream units(unitsPath);
+            if (!units) throw std::runtime_error("can't open " + unitsPath);
+            registry.load(units, unitsPath);
+        }
+
+        std::ifstream in(paths[0]);
+        if (!in) throw std::runtime_error("can't open " + paths[0]);
+        Scenario scenario = parseScenario(in, paths[0], registry);
+        writeScenario(scenario, paths[1]);
+
+        std::cout << paths[1] << ": " << scenario.types.size() << " unit types, "
+                  << scenario.marineGroups.back().end << " Marines in " << scenario.marineGroups.size() << " group(s), "
+                  << scenario.bugGroups.back().end << " Bugs in " << scenario.bugGroups.size() << " group(s), "
+                  << scenario.overrides.size() << " soldier override(s), " << scenario.reinforcements.size() << " wave(s).\n";
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
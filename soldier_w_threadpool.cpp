@@ -4,104 +4,394 @@
 // Added a naming convention, so we can see who's shooting whom, total hits, total kills.
 // Race conditions still exist for this scoring, despite the atomic set of dead. 
 // All data processing for stats is done in postProcessing().
+// Workers are pinned to cores and grouped by NUMA node. Each node has its own task queue
+// and its own partition of the combatant store, whose pages are bound to that node (mbind), so
+// they land there even when a worker of another node steals the task that builds them. Workers
+// drain their own node's queue before stealing. After the fight the store reports where its
+// pages actually are (move_pages), and the remote-access ratio is counted against that.
+// Soldiers are C++20 coroutines instead of looping tasks. A soldier attacks, then co_awaits its
+// next action time. A waiting soldier costs one small coroutine frame, not a worker, so every soldier gets to act.
+// Time is simulated: a discrete-event clock built on a hierarchical timing wheel resumes everyone
+// due at the next event time on the pool, then jumps straight to the following event time.
+// Nothing sleeps. Each unit type has its own attack speed, Marines reload, and crits stun.
+// Each tick is a TaskGraph: soldiers pick targets and attack (one step per node), then damage is
+// applied per side, then stats and logging run side by side. Attacks only stage strikes and log
+// lines per worker, so health and kills are settled by one thread per side and the output is
+// printed by one step instead of every worker fighting over std::cout.
+// Each soldier keeps its own hit and kill counts, written by one thread at a time. Only each side's
+// hit total, bumped by every worker, goes into per-worker counter shards (stats.h) added up when read.
+// Built with -DBUGHUNT_METRICS=1, attack and tick timings, queue depths and task waits are recorded
+// (metrics.h) and dumped after the fight; --metrics-every=MS also dumps them while it runs.
+// Built with -DBUGHUNT_TRACE=1, --trace=FILE writes a timeline of every worker's tasks and each
+// tick's phases (trace.h) that chrome://tracing or ui.perfetto.dev can open.
+// --perf counts cycles, instructions, cache and branch misses per phase (perf_counters.h) and
+// reports them next to attacks per second.
+// The pool itself (pinning, per-node queues, move-only Tasks, futures, task graphs) lives in threadpool.h.
+// Build with -std=c++20.
 
 // TODO: lots of collisions still happening, eg marines are killing one bug and it
 // translates to the kiling of the entire swarm.
-// Need a separate thread for logging.
-// v0.05
+// v0.12
 
 #include <iostream>
 #include <vector>
 #include <thread>
 #include <atomic>
-#include <queue>
 #include <mutex>
 #include <condition_variable>
-#include <functional>
-#include <future>
 #include <string>
-
+#include <sstream>
+#include <algorithm>
+#include <coroutine>
+#include <chrono>
+#include <array>
+#include <optional>
+
+#include "threadpool.h"
+#include "stats.h"
+#include "metrics.h"
+#include "trace.h"
+#include "perf_counters.h"
+
+// Soldiers live in contiguous per-node partitions instead of one heap allocation each.
+// Every partition is memory bound to its node (allocateOnNode()) and constructed by a task queued
+// on that node. Any worker may steal that task, but the binding still puts the pages on the node.
+// Soldier i belongs to the partition covering its index, and tasks for that soldier are queued on the
+// same node. Once built, each partition checks where its pages went (placedNodeOf()).
 template<typename T>
-class ThreadSafeQueue {
+class CombatantStore {
 public:
-    //Push a task to the queue
-    void push(const T& item) {
-        std::lock_guard<std::mutex> loc(mtx);
-        queue.push(item);
-        cv.notify_one();    //notifiy one waiting thread
+    // make(index, where) placement-news soldier #index into where
+    template<typename Factory>
+    CombatantStore(ThreadPool& pool, size_t count, Factory make) : count(count) {
+        std::vector<int> nodes = pool.activeNodes();
+        std::vector<Future<void>> built;
+
+        for (size_t p = 0; p < nodes.size(); ++p) {
+            Partition part;
+            part.node = nodes[p];
+            part.begin = count * p / nodes.size();
+            part.end = count * (p + 1) / nodes.size();
+            partitions.push_back(part);
+        }
+
+        for (Partition& part : partitions) {
+            part.memory = allocateOnNode(pool.topology(), part.node, sizeof(T) * (part.end - part.begin));
+            part.soldiers = static_cast<T*>(part.memory.data);
+            built.push_back(pool.submit([&part, &make]() {
+                for (size_t i = 0; i < part.end - part.begin; ++i) {
+                    make(part.begin + i, &part.soldiers[i]);
+                }
+            }, part.node));
+        }
+
+        for (auto& future : built) {
+            future.get();
+        }
+        for (Partition& part : partitions) {
+            part.placed = nodeOfPages(pool.topology(), part.memory);
+        }
     }
 
-    // Threads pop a task off the queue
-    T pop() {
-        std::unique_lock<std::mutex> lock(mtx);
-        // capture ThreadSafeQueue member variables, no params
-        cv.wait(lock, [this]() {return !queue.empty(); });  // lock if the queue is not empty
-        T item = queue.front();
-        queue.pop();
-        return item;
+    ~CombatantStore() {
+        for (Partition& part : partitions) {
+            if (!part.soldiers) continue;
+            for (size_t i = 0; i < part.end - part.begin; ++i) {
+                part.soldiers[i].~T();
+            }
+            freeNodeMemory(part.memory);
+        }
+    }
+
+    CombatantStore(const CombatantStore&) = delete;
+    CombatantStore& operator=(const CombatantStore&) = delete;
+
+    size_t size() const { return count; }
+
+    T& operator[](size_t i) {
+        const Partition& part = partitionOf(i);
+        return part.soldiers[i - part.begin];
+    }
+
+    const T& operator[](size_t i) const {
+        const Partition& part = partitionOf(i);
+        return part.soldiers[i - part.begin];
     }
 
-    bool empty() {
-        std::lock_guard<std::mutex> lock(mtx);
-        return queue.empty();
+    // The node soldier i's tasks are queued on
+    int nodeOf(size_t i) const { return partitionOf(i).node; }
+    // The node soldier i's record was found on, -1 if the kernel couldn't say
+    int placedNodeOf(size_t i) const { return partitionOf(i).placed; }
+
+    // How many partitions pass check: bound to their node, found on it, or checked at all
+    template <typename Check>
+    size_t countPartitions(Check check) const {
+        return size_t(std::count_if(partitions.begin(), partitions.end(), check));
     }
+    size_t partitionsBound() const { return countPartitions([](const Partition& p) { return p.memory.bound; }); }
+    size_t partitionsPlaced() const { return countPartitions([](const Partition& p) { return p.placed == p.node; }); }
+    size_t partitionsChecked() const { return countPartitions([](const Partition& p) { return p.placed >= 0; }); }
+    size_t partitionCount() const { return partitions.size(); }
 
 private:
-    std::queue<T> queue;
-    std::mutex mtx;
-    std::condition_variable cv;
+    struct Partition {
+        int node = 0;
+        int placed = -1;
+        size_t begin = 0;
+        size_t end = 0;
+        NodeMemory memory;
+        T* soldiers = nullptr;
+    };
+
+    // Partitions are equal-sized blocks, so the owner can be computed instead of searched
+    const Partition& partitionOf(size_t i) const {
+        size_t p = i * partitions.size() / count;
+        while (i >= partitions[p].end) ++p;
+        while (i < partitions[p].begin) --p;
+        return partitions[p];
+    }
+
+    size_t count;
+    std::vector<Partition> partitions;
+};
+
+// Return type of a soldier's behaviour coroutine. The coroutine starts suspended so gameLoop
+// can put it on the battle clock, and its frame frees itself when the behaviour ends.
+struct Behaviour {
+    struct promise_type {
+        Behaviour get_return_object() {
+            return Behaviour{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        // Count frames so we can see how little a sleeping soldier costs
+        static void* operator new(size_t size) {
+            frameBytes += size;
+            ++frameCount;
+            return ::operator new(size);
+        }
+        static void operator delete(void* frame) { ::operator delete(frame); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+
+    static std::atomic<size_t> frameBytes;
+    static std::atomic<size_t> frameCount;
 };
 
-using Task =  std::function<void()>;
+std::atomic<size_t> Behaviour::frameBytes = 0;
+std::atomic<size_t> Behaviour::frameCount = 0;
 
-// This class manages a pool of threads, each of which continuously pulls tasks
-// from the queue and executes them. Tasks are submitted using submit().
-class ThreadPool {
+// Hierarchical timing wheel: 8 levels of 256 slots, one level per byte of the 64-bit event time.
+// An event sits at the level of the highest byte where its time differs from now, so insert is O(1).
+// When level 0 runs dry, the next occupied slot of a higher level is cascaded down, which happens
+// to each event at most once per level. Per-level occupancy bitmaps let popNext() jump straight to
+// the next non-empty slot instead of ticking through empty time.
+template<typename Event>
+class TimingWheel {
 public:
-    ThreadPool(size_t numThreads) : stopFlag(false) {
-        //start worker threads
-        for (size_t i = 0; i < numThreads; ++i) {
-            workers.push_back(std::thread(&ThreadPool::worker, this));
+    uint64_t now() const { return current; }
+    bool empty() const { return count == 0; }
+
+    void insert(Event event) {
+        event.time = std::max(event.time, current);     // nothing gets scheduled in the past
+        int level = levelFor(event.time);
+        size_t slot = (event.time >> (8 * level)) & (kSlots - 1);
+        slots[level][slot].push_back(event);
+        bitmap[level][slot >> 6] |= uint64_t(1) << (slot & 63);
+        ++count;
+    }
+
+    // Advance now to the earliest pending time and move every event due at that time into due
+    bool popNext(std::vector<Event>& due) {
+        while (count > 0) {
+            int slot = findFrom(0, current & (kSlots - 1));
+            if (slot >= 0) {
+                current = (current & ~uint64_t(kSlots - 1)) | slot;
+                std::vector<Event>& events = slots[0][slot];
+                due.insert(due.end(), events.begin(), events.end());
+                count -= events.size();
+                events.clear();     // keeps its capacity for the next lap
+                bitmap[0][slot >> 6] &= ~(uint64_t(1) << (slot & 63));
+                return true;
+            }
+            if (!cascade()) break;
+        }
+        return false;
+    }
+
+private:
+    static constexpr int kLevels = 8;
+    static constexpr size_t kSlots = 256;
+
+    int levelFor(uint64_t time) const {
+        uint64_t diff = time ^ current;
+        return diff == 0 ? 0 : (63 - __builtin_clzll(diff)) / 8;
+    }
+
+    // First occupied slot at or after from, -1 if none
+    int findFrom(int level, size_t from) const {
+        for (size_t word = from >> 6; word < kSlots / 64; ++word) {
+            uint64_t bits = bitmap[level][word];
+            if (word == (from >> 6)) bits &= ~uint64_t(0) << (from & 63);
+            if (bits) return int(word * 64 + __builtin_ctzll(bits));
         }
+        return -1;
     }
 
-    ~ThreadPool(){
-        {
-            std::lock_guard<std::mutex> lock(mtx);
-            stopFlag = true;
+    // Jump now to the start of the next occupied higher-level slot and spread its events over the lower levels.
+    // Everything at a level sits after now's slot at that level, so the search starts one past it.
+    bool cascade() {
+        for (int level = 1; level < kLevels; ++level) {
+            int shift = 8 * level;
+            int slot = findFrom(level, ((current >> shift) & (kSlots - 1)) + 1);
+            if (slot < 0) continue;
+
+            uint64_t above = shift + 8 >= 64 ? 0 : (current >> (shift + 8)) << (shift + 8);
+            current = above | (uint64_t(slot) << shift);
+
+            scratch.swap(slots[level][slot]);
+            bitmap[level][slot >> 6] &= ~(uint64_t(1) << (slot & 63));
+            count -= scratch.size();
+            for (const Event& event : scratch) insert(event);
+            scratch.clear();
+            return true;
         }
-        cv.notify_all();
-        for (std::thread& worker : workers) {
-            if (worker.joinable()) {
-                worker.join();
-            }
+        return false;
+    }
+
+    uint64_t current = 0;
+    size_t count = 0;
+    std::array<std::array<std::vector<Event>, kSlots>, kLevels> slots;
+    std::array<std::array<uint64_t, kSlots / 64>, kLevels> bitmap{};
+    std::vector<Event> scratch;
+};
+
+// Discrete-event clock for the battle. Time is simulated milliseconds. run() takes the next occupied
+// time off the wheel, runs one tick (every soldier due then is resumed on its own node, followed by
+// whatever steps were added with afterActions()), and jumps to the next event time.
+class BattleClock {
+public:
+    BattleClock(ThreadPool& pool) : pool(pool), staged(pool.size() + 1), byNode(pool.numNodes()) {
+        static constexpr size_t kChunk = 64;
+        for (size_t node = 0; node < byNode.size(); ++node) {
+            resumeSteps.push_back(tickGraph.add([this, node]() {
+                static size_t attackPhase = PerfPhases::instance().phase("attack");
+                std::vector<std::coroutine_handle<>>& handles = byNode[node];
+                size_t chunks = (handles.size() + kChunk - 1) / kChunk;
+                // Chunk by hand so each chunk of soldiers is one perf scope on whichever thread runs it
+                this->pool.parallelFor(0, chunks, [&handles](size_t chunk) {
+                    PerfScope scope(attackPhase);
+                    size_t end = std::min(handles.size(), (chunk + 1) * kChunk);
+                    for (size_t i = chunk * kChunk; i < end; ++i) handles[i].resume();
+                }, 1);
+            }, node, "attack"));
         }
     }
 
-    void submit (Task task) {
-        taskQueue.push(task);
-        cv.notify_one();
+    // Add a step to every tick that runs once all of the tick's soldiers have acted.
+    // Further steps can be chained off it through tick().
+    template<typename F>
+    TaskGraph::Step afterActions(F&& fn, const char* name) {
+        TaskGraph::Step step = tickGraph.add(std::forward<F>(fn), 0, name);
+        for (TaskGraph::Step resume : resumeSteps) tickGraph.precede(resume, step);
+        return step;
+    }
+
+    TaskGraph& tick() { return tickGraph; }
+
+    uint64_t now() const { return wheel.now(); }
+    uint64_t eventsFired() const { return fired; }
+    uint64_t eventTimes() const { return steps; }
+
+    // Resume handle on a worker of node, delay ms of battle time from now.
+    // Soldiers call this mid-batch, so each worker stages into its own list and run() merges them afterwards.
+    void schedule(std::coroutine_handle<> handle, uint64_t delay, int node) {
+        int worker = ThreadPool::currentWorker();
+        staged[worker >= 0 ? worker : staged.size() - 1].events.push_back({now() + delay, handle, node});
+    }
+
+    // co_await clock.after(delay, node)
+    struct Awaiter {
+        BattleClock& clock;
+        uint64_t delay;
+        int node;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { clock.schedule(handle, delay, node); }
+        void await_resume() const noexcept {}
+    };
+
+    Awaiter after(uint64_t delay, int node) {
+        return Awaiter{*this, delay, node};
+    }
+
+    // Fire events until nobody is waiting on the clock
+    void run() {
+        static metrics::Histogram& tickNs = metrics::histogram("battle.tick_ns");
+        static metrics::Gauge& dueSoldiers = metrics::gauge("battle.soldiers_due");
+        std::vector<TimerEvent> due;
+        mergeStaged();
+        while (wheel.popNext(due)) {
+            ++steps;
+            fired += due.size();
+            dueSoldiers.set(due.size());
+            metrics::ScopedTimer timer(tickNs);
+            trace::Span span("tick", "clock");
+            dispatch(due);
+            due.clear();
+            mergeStaged();
+        }
     }
 
 private:
-    void worker() {
-        while (true) {
-            Task task;
-            {
-                std::unique_lock<std::mutex> lock(mtx);
-                cv.wait(lock, [this]() {return stopFlag || !taskQueue.empty(); });
-                if (stopFlag && taskQueue.empty()) return;
-                task = taskQueue.pop();
-            }
-            task(); //execute the task
+    struct TimerEvent {
+        uint64_t time;
+        std::coroutine_handle<> handle;
+        int node;
+    };
+
+    // Padded so workers staging events side by side don't false-share the vector headers
+    struct alignas(64) Staged {
+        std::vector<TimerEvent> events;
+    };
+
+    void mergeStaged() {
+        for (Staged& stage : staged) {
+            for (const TimerEvent& event : stage.events) wheel.insert(event);
+            stage.events.clear();
         }
     }
 
-    std::vector<std::thread> workers;
-    ThreadSafeQueue<Task> taskQueue;
-    std::mutex mtx;
-    std::condition_variable cv;
-    bool stopFlag;
+    // Sort this time step's soldiers by node and run the tick graph over them
+    void dispatch(const std::vector<TimerEvent>& due) {
+        for (auto& handles : byNode) handles.clear();
+        for (const TimerEvent& event : due) byNode[event.node % byNode.size()].push_back(event.handle);
+        tickGraph.run(pool);
+    }
+
+    ThreadPool& pool;
+    TimingWheel<TimerEvent> wheel;
+    std::vector<Staged> staged;
+    std::vector<std::vector<std::coroutine_handle<>>> byNode;
+    TaskGraph tickGraph;
+    std::vector<TaskGraph::Step> resumeSteps;     // one per node, everything else comes after these
+    uint64_t fired = 0;
+    uint64_t steps = 0;
+};
+
+class Soldier;
+
+// A blow that landed. Attacks only stage these, the damage phase of the tick applies them.
+struct Strike {
+    Soldier* attacker;
+    Soldier* target;
+    int damage;
+    int stun;
+    bool piercing;      // goes straight to health, skipping takeDamage() (and so the Bug's carapace)
 };
 
 class Soldier{
@@ -109,32 +399,55 @@ public:
     std::string name;
     int health;
     int base_to_hit = 10;
-    int hits = 0;
-    int kill_count = 0;
     std::vector<std::string> enemies_killed;
+    // Counted by this soldier's own attacks; its coroutine runs on one worker at a time
+    uint32_t hits = 0;
+    // Counted by the damage step for the other side, the only step that settles this soldier's kills
+    uint32_t kills = 0;
 
     // With atomic r/w, a thread always sees a consisent state of the var. Does not require locks.
     std::atomic<bool> alive;
+    // Set once by whichever attacker claims the kill. takeDamage() clears alive itself (and Bug::slay
+    // doesn't), so alive can't be used to decide who scored the kill.
+    std::atomic<bool> fallen{false};
+
+    // Battle time in ms between this soldier's actions
+    int attack_interval = 100;
+    // How long a critical hit from this soldier stuns its target
+    int stun_time = 0;
+    // Stun waiting to be served, the soldier loses this much time before its next action
+    std::atomic<int> stunned{0};
 
     // Constructor to initialize attributes
     // Needs to be initialized BEFORE functions pass it as an arg
     Soldier(const std::string& name) : name(name), health(100), alive(true) {}
     
-    // Pure virtual method as each soldier will have a different attack
-    virtual void attack(Soldier* target) = 0;
+    // Pure virtual method as each soldier will have a different attack.
+    // Rolls the attack against target and returns the strike if it lands. Nothing is done to the
+    // target here, so attacks running side by side never write to the same soldier.
+    virtual std::optional<Strike> attack(Soldier* target, std::ostream& log) = 0;
+
+    // Time until this soldier acts again. Marines override this to reload.
+    virtual int nextActionDelay() { return attack_interval; }
+
+    // Keep the longest stun if several land before the target gets to act
+    void stunFor(int time) {
+        int current = stunned;
+        while (current < time && !stunned.compare_exchange_weak(current, time)) {}
+    }
 
     // Default one-shot
-    virtual void slay(Soldier* target) {
+    virtual Strike slay(Soldier* target, std::ostream& log) {
         int damage = 100;  // Default damage
-        target->takeDamage(damage);
-        std::cout << "Critical hit! " << name << " takes " << damage << " damage.\n";
+        log << "Critical hit! " << target->name << " takes " << damage << " damage.\n";
+        return {this, target, damage, 0, false};
     }
 
-    virtual void takeDamage(int damage) {
+    virtual void takeDamage(int damage, std::ostream& log) {
         health -= damage;
         if (health <= 0) {
             alive = false;
-            std::cout << name << " has been killed.\n";
+            log << name << " has been killed.\n";
         }
     }
 
@@ -146,31 +459,41 @@ class Marine : public Soldier {
 public:
     int accuracy = 7;
     int damage = 50;
+    int magazine = 6;       // shots before a reload
+    int reload_time = 400;
+    int rounds = magazine;
     //int marine_hit = 0;
 
-    Marine(const std::string& name) : Soldier(name) {}  // Pass name to Soldier constructor
+    Marine(const std::string& name) : Soldier(name) {  // Pass name to Soldier constructor
+        attack_interval = 100;
+        stun_time = 150;
+    }
+
+    int nextActionDelay() override {
+        if (--rounds > 0) return attack_interval;
+        rounds = magazine;
+        return reload_time;
+    }
 
     // Modifying the standard attack
-    void attack(Soldier* target) override {
-        std::cout << name << " is shooting...\n";
+    std::optional<Strike> attack(Soldier* target, std::ostream& log) override {
+        log << name << " is shooting...\n";
         int to_hit = rand() % 10 + 1;
 
         if (to_hit > accuracy){
-            std::cout << name << " hits!\n";
-            hits++;
+            log << name << " hits!\n";
             if (to_hit == base_to_hit) {
-                slay(target);
-            } else {
-                target->takeDamage(damage);     // Standard hit
+                return slay(target, log);
             }
-        } else {
-            std::cout << name << " misses...\n";
+            return Strike{this, target, damage, 0, false};     // Standard hit
         }
+        log << name << " misses...\n";
+        return std::nullopt;
     }
 
-    void slay(Soldier* target) override {
-        std::cout << name << " scores a headshot!\n";
-        target->takeDamage(damage*2);    // Critical hit
+    Strike slay(Soldier* target, std::ostream& log) override {
+        log << name << " scores a headshot!\n";
+        return {this, target, damage*2, stun_time, false};     // Critical hit
     }
 };
 
@@ -181,157 +504,322 @@ public:
     bool carapace = true;
     //int bug_hit = 0;
     
-    Bug(const std::string& name) : Soldier(name) {}  // Pass name to Soldier constructor
+    Bug(const std::string& name) : Soldier(name) {  // Pass name to Soldier constructor
+        attack_interval = 70;   // claws are quicker than a rifle
+        stun_time = 300;
+    }
 
-    void attack(Soldier* target) override {
-        std::cout << name << " attacks with its claws...\n";
+    std::optional<Strike> attack(Soldier* target, std::ostream& log) override {
+        log << name << " attacks with its claws...\n";
         int to_hit = rand() % 10 + 1;
 
         if (to_hit > accuracy) {
-            std::cout << name << " hits!\n";
-            hits++;
+            log << name << " hits!\n";
             if (to_hit == base_to_hit) {
-                slay(target);
-            } else {
-                target->takeDamage(damage);
+                return slay(target, log);
             }
-        } else {
-        std::cout << name << " misses...\n";
+            return Strike{this, target, damage, 0, false};
         }
+        log << name << " misses...\n";
+        return std::nullopt;
     }
 
-    void slay(Soldier* target) override {
-        std::cout << name << " finds a gap in the Marine's armor!\n";
-        target->health -= (damage*2);
+    Strike slay(Soldier* target, std::ostream& log) override {
+        log << name << " finds a gap in the Marine's armor!\n";
+        return {this, target, damage*2, stun_time, true};
     }
-    void takeDamage(int damage) override {
+    void takeDamage(int damage, std::ostream& log) override {
         health -= damage;
         if (health <= 0 && carapace) {
-            std::cout << name << "'s carapace protected it from a killing blow!\n";
+            log << name << "'s carapace protected it from a killing blow!\n";
             health += 50; // Restore some health
             carapace = false;
         } else if (health <= 0) {
             alive = false;
-            std::cout << name << " has fallen!\n";
+            log << name << " has fallen!\n";
         }
     }
 };
 
-void gameLoop(std::vector<std::unique_ptr<Marine>>& marineCorps, std::vector<std::unique_ptr<Bug>>& bugSwarm, ThreadPool& pool) {
+// One soldier's whole fight: attack a random enemy, then wait on the battle clock until the next action time.
+// Everything the soldier needs between attacks lives in this frame, so a million of these
+// only need a few workers. Ends when the soldier dies or the battle is over.
+template<typename Enemy, typename BattleFn>
+Behaviour fight(BattleClock& clock, Soldier& self, int selfNode, int selfPlaced, CombatantStore<Enemy>& enemies,
+                BattleFn& battle, const std::atomic<bool>& gameOver, bool isMarineAttacking) {
+    while (!gameOver && self.alive) {
+        // A stunned soldier loses its action until the stun wears off
+        if (int stun = self.stunned.exchange(0); stun > 0) {
+            co_await clock.after(stun, selfNode);
+            continue;
+        }
+
+        // Choose a random target from the opposing team
+        size_t t = rand() % enemies.size();
+        battle(&self, selfPlaced, &enemies[t], enemies.placedNodeOf(t), isMarineAttacking);
+        co_await clock.after(self.nextActionDelay(), selfNode);
+    }
+}
+
+// What soldiers produce while acting in one tick. Each worker fills its own slot, so the attack
+// phase shares nothing writable; the damage and logging phases read every slot afterwards.
+struct alignas(64) ActionSlot {
+    std::vector<Strike> onMarines;
+    std::vector<Strike> onBugs;
+    std::ostringstream log;
+    uint64_t attacks = 0;
+};
+
+// Each side's hit total. Every worker lands hits for both sides, so the totals are counted into
+// per-worker shards and added up afterwards. Per-soldier counts live on the soldiers themselves.
+struct BattleStats {
+    enum Counter : size_t { kMarineHits, kBugHits, kCounters };
+    ShardedCounters<> hits;
+
+    explicit BattleStats(const ThreadPool& pool) : hits(pool, kCounters) {}
+};
+
+// Strikes that landed and kills made on one side in one tick
+struct TickTotals {
+    size_t strikes = 0;
+    size_t kills = 0;
+};
+
+void gameLoop(CombatantStore<Marine>& marineCorps, CombatantStore<Bug>& bugSwarm, ThreadPool& pool, BattleStats& stats) {
     std::atomic<bool> gameOver = false;
     size_t marineCount = marineCorps.size();
     size_t bugCount = bugSwarm.size();
-    int sleep_time = 100;
     
     std::cout << "This fight is between " << marineCount << " Marines and " << bugCount << " Bugs!\n"; 
 
-    // Combat lambda for turn based combat 
-    auto battle = [&gameOver, &marineCount, &bugCount](Soldier* attacker, Soldier* defender, bool isMarineAttacking) {
+    std::vector<ActionSlot> slots(pool.size() + 1);
+    auto mySlot = [&slots]() -> ActionSlot& {
+        int worker = ThreadPool::currentWorker();
+        return slots[worker >= 0 ? worker : slots.size() - 1];
+    };
+
+    // Combat lambda for turn based combat, run by the soldier's coroutine in the attack phase.
+    // attackerNode/defenderNode say where each soldier's record was found to be, for the remote-access report
+    auto battle = [&pool, &mySlot, &stats](Soldier* attacker, int attackerNode, Soldier* defender, int defenderNode, bool isMarineAttacking) {
+        pool.recordAccess(attackerNode);
+        pool.recordAccess(defenderNode);
+        // health and alive only change in the damage phase, so reading them here doesn't race
         if(!attacker->alive || !defender->alive) return;
-        
-        attacker->attack(defender);
-
-        // Tried to simply check if the defender was alive, but that led to race conditions
-        //if (!defender->alive) {
-
-        // Check if the defender survived the attack
-        // This solution isn't better for 
-        if (defender->health <= 0) {
-            // Attempt to atomically mark the defender as dead
-            // If this thread successfully marks the defender as dead, it gets the kill
-            if(!defender->alive.exchange(false)) {
-                attacker->enemies_killed.push_back(defender->name);
-                std::cout << attacker->name << " scores a kill on " << defender->name << "!\n";
-
-                // Update the counters and check for gameOver
-                if (isMarineAttacking) {
-                    --bugCount;
-                    std::cout << bugCount << " bugs remain!\n";
-                    if (bugCount == 0) gameOver = true;
+
+        static metrics::Histogram& attackNs = metrics::histogram("battle.attack_ns");
+        static metrics::Counter& attacks = metrics::counter("battle.attacks");
+        attacks.add();
+        ActionSlot& slot = mySlot();
+        ++slot.attacks;
+        metrics::ScopedTimer timer(attackNs);
+        if (std::optional<Strike> strike = attacker->attack(defender, slot.log)) {
+            ++attacker->hits;
+            stats.hits.add(isMarineAttacking ? BattleStats::kMarineHits : BattleStats::kBugHits);
+            (isMarineAttacking ? slot.onBugs : slot.onMarines).push_back(*strike);
+        }
+    };
+
+    // Damage phase for one side: apply the strikes that landed on it this tick, in staging order.
+    // Nothing else touches this side's health while it runs, so the strike that drops a soldier
+    // gets the kill and the count of soldiers left is exact.
+    std::ostringstream damageLog[2];
+    TickTotals tickTotals[2];
+    auto applyStrikes = [&](bool onMarines) {
+        static size_t damagePhase = PerfPhases::instance().phase("damage apply");
+        PerfScope scope(damagePhase);
+        std::ostringstream& log = damageLog[onMarines];
+        TickTotals& totals = tickTotals[onMarines];
+        size_t& remaining = onMarines ? marineCount : bugCount;
+        totals = {};
+
+        for (ActionSlot& slot : slots) {
+            std::vector<Strike>& strikes = onMarines ? slot.onMarines : slot.onBugs;
+            for (const Strike& strike : strikes) {
+                Soldier* target = strike.target;
+                if (target->fallen) continue;   // already dropped by an earlier strike this tick
+                ++totals.strikes;
+
+                if (strike.piercing) {
+                    target->health -= strike.damage;
                 } else {
-                    --marineCount;
-                    std::cout << marineCount << " Marines remain!\n";
-                    if (marineCount == 0) gameOver = true;
+                    target->takeDamage(strike.damage, log);
+                }
+                if (strike.stun > 0) target->stunFor(strike.stun);
+
+                if (target->health <= 0) {
+                    target->fallen = true;
+                    target->alive = false;
+                    strike.attacker->enemies_killed.push_back(target->name);
+                    ++strike.attacker->kills;
+                    ++totals.kills;
+                    log << strike.attacker->name << " scores a kill on " << target->name << "!\n";
+
+                    --remaining;
+                    log << remaining << (onMarines ? " Marines remain!\n" : " bugs remain!\n");
+                    if (remaining == 0) gameOver = true;
                 }
             }
+            strikes.clear();
         }
     };
     
-    // Instead of dynamically creating a vector of threads, this version submits tasks to a pool of threads
-    while (!gameOver) {
-        // Marines attack Bugs
-        for (auto& marine : marineCorps) {
-            // Create a new thread and add it to the threads vector
-            // emplace_back() directly constructs the thread obj in the vector without creating and copying a temp thread obj
-            // [&] captures variables from the surrounding sopr by reference (can access gameOver, bugSwarm, and battle())
-            if (marine->alive) {
-                pool.submit([&marine, &bugSwarm, &battle, &gameOver, sleep_time]() {
-                    while (!gameOver) {
-                        // Choose a random target from the opposing team
-                        Soldier* target = bugSwarm[rand() % bugSwarm.size()].get();
-
-                        // Calls battle() with the pointer to the Marine, the target, and true for isMarineAttacking
-                        battle(marine.get(), target, true);
-                        std::this_thread::sleep_for(std::chrono::milliseconds(sleep_time));
-                    }
-                });
-            }
+    // Instead of a looping task per soldier, each soldier is a coroutine resumed by the battle clock.
+    // Every tick runs as a graph: all attacks -> damage to Marines | damage to Bugs -> tick stats | logging
+    BattleClock clock(pool);
+    TaskGraph& tick = clock.tick();
+    TaskGraph::Step damageMarines = clock.afterActions([&applyStrikes]() { applyStrikes(true); }, "damage Marines");
+    TaskGraph::Step damageBugs = clock.afterActions([&applyStrikes]() { applyStrikes(false); }, "damage Bugs");
+
+    uint64_t strikesLanded = 0;
+    size_t bloodiestKills = 0;
+    uint64_t bloodiestTime = 0;
+    TaskGraph::Step tickStats = tick.add([&]() {
+        static size_t statsPhase = PerfPhases::instance().phase("stats");
+        PerfScope scope(statsPhase);
+        size_t kills = tickTotals[0].kills + tickTotals[1].kills;
+        strikesLanded += tickTotals[0].strikes + tickTotals[1].strikes;
+        if (kills > bloodiestKills) {
+            bloodiestKills = kills;
+            bloodiestTime = clock.now();
         }
+    }, 0, "tick stats");
 
-        // Bugs attack Marines
-        for (auto& bug : bugSwarm) {
-            if (bug->alive) {
-                pool.submit([&bug, &marineCorps, &battle, &gameOver, sleep_time]() {
-                    while (!gameOver) {
-                        Soldier* target = marineCorps[rand() % marineCorps.size()].get();
-
-                        battle(bug.get(), target, false);
-                        std::this_thread::sleep_for(std::chrono::milliseconds(sleep_time));
-                    }
-                });
-            } 
+    // The only step that prints during the fight: attacks first, then what they did
+    TaskGraph::Step logging = tick.add([&slots, &damageLog]() {
+        for (ActionSlot& slot : slots) {
+            std::cout << slot.log.str();
+            slot.log.str("");
+        }
+        for (std::ostringstream& log : damageLog) {
+            std::cout << log.str();
+            log.str("");
         }
+    }, 0, "logging");
 
-        // Allow some time for tasks to process
-        std::this_thread::sleep_for(std::chrono::milliseconds(sleep_time*5));
-    
-        if (gameOver) break;
+    for (TaskGraph::Step damage : {damageMarines, damageBugs}) {
+        tick.precede(damage, tickStats);
+        tick.precede(damage, logging);
+    }
+
+    // First actions are staggered over one attack interval so the armies don't all swing on the same tick.
+    for (size_t i = 0; i < marineCorps.size(); ++i) {
+        Marine& marine = marineCorps[i];
+        int node = marineCorps.nodeOf(i);
+        clock.schedule(fight(clock, marine, node, marineCorps.placedNodeOf(i), bugSwarm, battle, gameOver, true).handle,
+                       rand() % marine.attack_interval, node);
+    }
+
+    for (size_t i = 0; i < bugSwarm.size(); ++i) {
+        Bug& bug = bugSwarm[i];
+        int node = bugSwarm.nodeOf(i);
+        clock.schedule(fight(clock, bug, node, bugSwarm.placedNodeOf(i), marineCorps, battle, gameOver, false).handle,
+                       rand() % bug.attack_interval, node);
     }
 
+    // Runs until every soldier has stood down, no guessing with sleeps
+    auto wallStart = std::chrono::steady_clock::now();
+    clock.run();
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    pool.waitIdle();
+
+    // Recount survivors from the soldiers themselves as a check on the running counts
+    auto countAlive = [&pool](auto& force) {
+        return pool.parallelReduce(size_t(0), force.size(), size_t(0),
+            [&force](size_t i) { return size_t(force[i].alive ? 1 : 0); },
+            [](size_t a, size_t b) { return a + b; });
+    };
+    size_t marinesStanding = countAlive(marineCorps);
+    size_t bugsStanding = countAlive(bugSwarm);
+    std::cout << marinesStanding << " Marines and " << bugsStanding << " Bugs left standing.\n";
+
     // Only in death does duty end.
-    if (marineCount > 0) {
+    if (marinesStanding > 0) {
         std::cout << "Marine victory!\n";
     } else {
         std::cout << "Bugs triumphant!\n";
     }
-}
 
-void postProcessing(const std::vector<std::unique_ptr<Marine>>& marineCorps, 
-                    const std::vector<std::unique_ptr<Bug>>& bugSwarm) {
+    AccessCounter accesses = pool.accessTotals();
+    uint64_t totalAccesses = accesses.local + accesses.remote;
+    std::cout << "\nNUMA: " << pool.size() << " workers (" << pool.pinned() << " pinned) over "
+              << pool.numNodes() << " node(s).\n";
+    size_t partitions = marineCorps.partitionCount() + bugSwarm.partitionCount();
+    std::cout << "Store partitions: " << marineCorps.partitionsBound() + bugSwarm.partitionsBound() << " of "
+              << partitions << " bound to their node, " << marineCorps.partitionsPlaced() + bugSwarm.partitionsPlaced()
+              << " of " << marineCorps.partitionsChecked() + bugSwarm.partitionsChecked() << " checked found there.\n";
+    std::cout << "Soldier accesses: " << accesses.local << " node-local, " << accesses.remote << " remote";
+    if (totalAccesses > 0) {
+        std::cout << " (remote ratio " << (100.0 * accesses.remote / totalAccesses) << "%)";
+    }
+    if (accesses.unplaced > 0) {
+        std::cout << ", " << accesses.unplaced << " to soldiers whose pages couldn't be located";
+    }
+    std::cout << ".\n";
+
+    std::cout << "Battle lasted " << clock.now() / 1000.0 << "s of battle time: " << clock.eventsFired() << " events at "
+              << clock.eventTimes() << " distinct times, simulated in " << wallSeconds << "s";
+    if (wallSeconds > 0) {
+        std::cout << " (" << static_cast<uint64_t>(clock.eventsFired() / wallSeconds) << " events/s)";
+    }
+    std::cout << ".\n";
 
-    int total_marine_hits = 0, total_bug_hits = 0;
-    int total_marine_kills = 0, total_bug_kills = 0;
+    uint64_t attacks = 0;
+    for (const ActionSlot& slot : slots) attacks += slot.attacks;
+    std::cout << attacks << " attacks";
+    if (wallSeconds > 0) {
+        std::cout << " (" << static_cast<uint64_t>(attacks / wallSeconds) << " attacks/s)";
+    }
+    std::cout << ", " << strikesLanded << " strikes landed";
+    if (bloodiestKills > 0) {
+        std::cout << ", the bloodiest moment was " << bloodiestKills << " kill(s) at " << bloodiestTime / 1000.0 << "s";
+    }
+    std::cout << ".\n";
+
+    if (Behaviour::frameCount > 0) {
+        std::cout << Behaviour::frameCount << " soldier coroutines, " << Behaviour::frameBytes / Behaviour::frameCount
+                  << " bytes per frame.\n";
+    }
+}
+
+// Kill totals for a force. parallelReduce builds one per chunk of soldiers and merges them.
+struct Tally {
+    int kills = 0;
     int highest_kill_count = 0;
-    std::vector<Soldier*> top_killers;
-
-    auto tallyKills = [](const auto& force, int& total_hits, int& total_kills, int& highest_kill_count, std::vector<Soldier*>& top_killers) {
-        int kill_count = 0;
-        for (const auto& soldier : force) {
-            total_hits += soldier->hits;
-            kill_count = soldier->enemies_killed.size();    //reset kill count every soldier
-            total_kills += kill_count;
-            if (kill_count > highest_kill_count) {
-                highest_kill_count = kill_count;
-                top_killers.clear();
-                top_killers.push_back(soldier.get());
-            } else if (kill_count == highest_kill_count) {
-                top_killers.push_back(soldier.get());
-            }
-            }
-        };
+    std::vector<const Soldier*> top_killers;
+};
 
-    tallyKills(marineCorps, total_marine_hits, total_marine_kills, highest_kill_count, top_killers);
-    tallyKills(bugSwarm, total_bug_hits, total_bug_kills, highest_kill_count, top_killers);
+Tally mergeTallies(Tally a, Tally b) {
+    a.kills += b.kills;
+    if (b.highest_kill_count > a.highest_kill_count) {
+        a.highest_kill_count = b.highest_kill_count;
+        a.top_killers = std::move(b.top_killers);
+    } else if (b.highest_kill_count == a.highest_kill_count) {
+        a.top_killers.insert(a.top_killers.end(), b.top_killers.begin(), b.top_killers.end());
+    }
+    return a;
+}
+
+void postProcessing(const CombatantStore<Marine>& marineCorps, 
+                    const CombatantStore<Bug>& bugSwarm, ThreadPool& pool, const BattleStats& stats) {
+
+    auto tallyKills = [&pool](const auto& force) {
+        return pool.parallelReduce(size_t(0), force.size(), Tally{},
+            [&force](size_t i) {
+                const Soldier* soldier = &force[i];
+                Tally tally;
+                tally.kills = soldier->kills;
+                tally.highest_kill_count = tally.kills;
+                if (tally.kills > 0) tally.top_killers.push_back(soldier);     // nobody tops the board with zero kills
+                return tally;
+            },
+            mergeTallies);
+    };
+
+    Tally marineTally = tallyKills(marineCorps);
+    Tally bugTally = tallyKills(bugSwarm);
+    uint64_t total_marine_hits = stats.hits.total(BattleStats::kMarineHits);
+    uint64_t total_bug_hits = stats.hits.total(BattleStats::kBugHits);
+    Tally overall = mergeTallies(std::move(marineTally), std::move(bugTally));
     
 
     std::cout << "\nPost Fight Stats!\n";    
@@ -347,7 +835,8 @@ void postProcessing(const std::vector<std::unique_ptr<Marine>>& marineCorps,
     }
 
     auto processForce = [](const auto& force) {
-        for (const auto& soldier : force) {
+        for (size_t i = 0; i < force.size(); ++i) {
+            const Soldier* soldier = &force[i];
             if (soldier->enemies_killed.empty()) {
             std::cout << soldier->name << " killed: None\n";
             } else {
@@ -360,6 +849,14 @@ void postProcessing(const std::vector<std::unique_ptr<Marine>>& marineCorps,
         }
     };
 
+    if (!overall.top_killers.empty()) {
+        std::cout << "Top killer(s) with " << overall.highest_kill_count << " kills:";
+        for (const Soldier* soldier : overall.top_killers) {
+            std::cout << " " << soldier->name;
+        }
+        std::cout << "\n";
+    }
+
     std::cout << "\nMarine performance:\n";
     processForce(marineCorps);
 
@@ -367,20 +864,30 @@ void postProcessing(const std::vector<std::unique_ptr<Marine>>& marineCorps,
     processForce(bugSwarm);
 }
 
-int main() {
+int main(int argc, char* argv[]) {
     int marine_num = 0;
     int bug_num = 0;
 
+    // --metrics-every=MS dumps the metrics every MS ms during the fight (only with -DBUGHUNT_METRICS=1)
+    // --trace=FILE writes a trace-event timeline of the run to FILE (only with -DBUGHUNT_TRACE=1)
+    // --perf reports hardware counters per battle phase
+    int metricsEveryMs = 0;
+    std::string tracePath;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--metrics-every=", 0) == 0) metricsEveryMs = std::stoi(arg.substr(16));
+        if (arg.rfind("--trace=", 0) == 0) tracePath = arg.substr(8);
+        if (arg == "--perf") PerfPhases::instance().enable();
+    }
+    // Declared before the pool so it is written after the workers have been joined
+    trace::Session traceSession(tracePath);
+
     // Get the number of cores on this system. Thread count should max at double this number, -1 for the OS.
     int numCores = std::thread::hardware_concurrency();
     
     //seed the random number generator with the current time
     srand(time(0));
 
-    // Create vectors to hold different soldier types
-    std::vector<std::unique_ptr<Marine>> marineCorps;
-    std::vector<std::unique_ptr<Bug>> bugSwarm;
-
     std::cout << "In the grimdark winter of New England, man dreams of endless war with non-man...\n";
     std::cout << "This is a battle simulation of Marines vs Bugs, oorah!\n";
     
@@ -401,26 +908,33 @@ int main() {
     }
 
     // Construct a ThreadPool pool such that if marine + bug num > numCores-1, default to number of cores -1
-    // Else, the pool will be the sume of the combatants
+    // Else, the pool will be the sume of the combatants. Always at least one worker, even on a single core.
     ThreadPool pool(
-        (marine_num + bug_num) > (numCores - 1) ? (numCores-1) : marine_num + bug_num 
+        (marine_num + bug_num) > (numCores - 1) ? (numCores-1) : marine_num + bug_num,
+        NumaTopology::detect()
     );
 
-    for (int i = 1; i <= marine_num; i++) {
-            //std::string marine_name = "Marine" + std::to_string(i);
-            //marineCorps.emplace_back(std::make_unique<Marine>(marine_name));
-            marineCorps.emplace_back(std::make_unique<Marine>("Marine" + std::to_string(i)));
-    }
-
-    for (int i = 1; i <= bug_num; i++) {
-            //std::string bug_name = "Bug" + std::to_string(i);
-            //bugSwarm.emplace_back(std::make_unique<Bug>(bug_name));
-            bugSwarm.emplace_back(std::make_unique<Bug>("Bug" + std::to_string(i)));
-    }
+    // Create stores to hold different soldier types, split across the NUMA nodes the pool runs on.
+    // Each soldier is built in place, in memory bound to the node that will own it.
+    CombatantStore<Marine> marineCorps(pool, marine_num, [](size_t i, void* where) {
+        new (where) Marine("Marine" + std::to_string(i + 1));
+    });
+    CombatantStore<Bug> bugSwarm(pool, bug_num, [](size_t i, void* where) {
+        new (where) Bug("Bug" + std::to_string(i + 1));
+    });
 
     // Fight it out
-    gameLoop(marineCorps, bugSwarm, pool);
-    postProcessing(marineCorps, bugSwarm);
+    BattleStats stats(pool);
+    {
+        std::unique_ptr<metrics::Sampler> sampler;
+        if (metricsEveryMs > 0) {
+            sampler = std::make_unique<metrics::Sampler>(std::cerr, std::chrono::milliseconds(metricsEveryMs));
+        }
+        gameLoop(marineCorps, bugSwarm, pool, stats);
+    }
+    PerfPhases::instance().report(std::cout, "pool engine, " + std::to_string(pool.size()) + " worker(s)");
+    postProcessing(marineCorps, bugSwarm, pool, stats);
+    metrics::dump(std::cout);
     
     std::cout << "Hope you enjoyed the fight! Exiting...\n";
 
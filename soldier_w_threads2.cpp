@@ -3,6 +3,8 @@
 // Added a player request for how many marines and bugs will fight.
 // Removed dead soldiers (mark them inactive) so that they don't keep fighting after
 // their health is reduced to zero. Added logic to maintain their hit count afterward.
+// Each soldier's thread reports its hit count into its own padded slot when it finishes,
+// instead of every thread pushing into shared vectors, so the totals are exact.
 
 // TODO: Add first turn choice, separate fighting into turns.
 
@@ -15,6 +17,7 @@
 #include <cstdlib>
 #include <ctime>
 #include <numeric>  // For std::accumulate
+#include <memory>
 
 class Soldier{
     public:
@@ -121,6 +124,12 @@ class Bug : public Soldier {
         }
 };
 
+// One soldier thread's final hit count. alignas(64) keeps each on its own cache line
+// so threads reporting at the same time don't false-share.
+struct alignas(64) HitShard {
+    int hits = 0;
+};
+
 std::pair<int, int> gameLoop(std::vector<std::unique_ptr<Marine>>& marineForce, std::vector<std::unique_ptr<Bug>>& bugForce) {
     std::atomic<bool> gameOver = false;
     size_t marineCount = marineForce.size();
@@ -129,9 +138,9 @@ std::pair<int, int> gameLoop(std::vector<std::unique_ptr<Marine>>& marineForce,
     int total_marine_hits = 0;
     int total_bug_hits = 0;
 
-    // Tracking dead soldiers for stats
-    std::vector<int> marine_hits;  // Preserve marine hit counts
-    std::vector<int> bug_hits;     // Preserve bug hit counts
+    // One slot per soldier thread, written only by that thread, read after the join
+    std::vector<HitShard> marine_hits(marineForce.size());
+    std::vector<HitShard> bug_hits(bugForce.size());
 
     std::cout << "This fight is between " << marineCount << " Marines and " << bugCount << " Bugs!\n"; 
 
@@ -158,11 +167,12 @@ std::pair<int, int> gameLoop(std::vector<std::unique_ptr<Marine>>& marineForce,
         std::vector<std::thread> threads;
 
         // Marines attack Bugs
-        for (auto& marine : marineForce) {
+        for (size_t i = 0; i < marineForce.size(); ++i) {
+            auto& marine = marineForce[i];
             // Create a new thread and add it to the threads vector
             // emplace_back() directly constructs the thread obj in the vector without creating and copying a temp thread obj
             // [&] captures variables from the surrounding sopr by reference (can access gameOver, bugForce, and battle())
-            threads.emplace_back([&]() {
+            threads.emplace_back([&, i]() {
                 while (!gameOver) {
                     // Skip dead Marines
                     if (!marine->alive) continue;
@@ -172,19 +182,18 @@ std::pair<int, int> gameLoop(std::vector<std::unique_ptr<Marine>>& marineForce,
 
                     // Calls battle() with the pointer to the Marine, the target, and true for isMarineAttacking
                     battle(marine.get(), target, true);
-
-                    // Preserve marine's hit stats after death
-                    if (!marine->alive) {
-                        marine_hits.push_back(marine->marine_hit);
-                    }
                     std::this_thread::sleep_for(std::chrono::milliseconds(sleep_time));
                 }
+
+                // Only this thread ever changed marine_hit, so it's final now, dead or alive
+                marine_hits[i].hits = marine->marine_hit;
             });
         }
 
         // Bugs attack Marines
-        for (auto& bug : bugForce) {
-            threads.emplace_back([&]() {
+        for (size_t i = 0; i < bugForce.size(); ++i) {
+            auto& bug = bugForce[i];
+            threads.emplace_back([&, i]() {
                 while (!gameOver) {
                     // Skip dead Marines
                     if (!bug->alive) continue;
@@ -193,13 +202,10 @@ std::pair<int, int> gameLoop(std::vector<std::unique_ptr<Marine>>& marineForce,
 
                     battle(bug.get(), target, false);
 
-                    // Preserve marine's hit stats after death
-                    if (!bug->alive) {
-                        bug_hits.push_back(bug->bug_hit);
-                    }
-
                     std::this_thread::sleep_for(std::chrono::milliseconds(sleep_time));
                 }
+
+                bug_hits[i].hits = bug->bug_hit;
             }); 
         }
 
@@ -216,24 +222,10 @@ std::pair<int, int> gameLoop(std::vector<std::unique_ptr<Marine>>& marineForce,
         std::cout << "Bugs triumphant!\n";
     }
 
-    // Sum hits from active Marines and Bugs
-    // Don't want to modify the object (soldier) we're referencing, so this is a const
-    // Also better to reinforce std::unique_ptr is a non-copyable element
-    for (const auto& marine : marineForce) {
-        if (marine->alive) {
-            total_marine_hits += marine->marine_hit;
-        }
-    }
-    
-    for (const auto& bug : bugForce) {
-        if (bug->alive) {
-            total_bug_hits += bug->bug_hit;
-        }
-    }
-
-    // Add stats from dead soldiers
-    total_marine_hits += std::accumulate(marine_hits.begin(), marine_hits.end(), 0);
-    total_bug_hits += std::accumulate(bug_hits.begin(), bug_hits.end(), 0);
+    // Merge the slots now that every thread has joined. Covers living and dead soldiers alike.
+    auto addShard = [](int sum, const HitShard& shard) { return sum + shard.hits; };
+    total_marine_hits = std::accumulate(marine_hits.begin(), marine_hits.end(), 0, addShard);
+    total_bug_hits = std::accumulate(bug_hits.begin(), bug_hits.end(), 0, addShard);
 
     return {total_marine_hits, total_bug_hits};
 }
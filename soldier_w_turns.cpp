@@ -4,6 +4,30 @@
 // Added a player request for how many marines and bugs will fight.
 // Removed dead soldiers (mark them inactive) so that they don't keep fighting after
 // their health is reduced to zero. Added logic to maintain their hit count afterward.
+// --perf counts cycles, instructions, cache and branch misses for the attack and stats phases
+// (perf_counters.h) and reports attacks per second of attack-phase time, so it can be compared
+// with the pool engine. Damage is applied inside attack() here, so it counts as attack.
+// The battle is plain data (battle_state.h): soldier records, the RNG, the turn and a kill ledger.
+// --checkpoint=FILE snapshots it every few turns and --restore=FILE maps a snapshot back in and
+// carries on, which also lets a what-if run branch off a mid-battle state with a new --seed.
+// Unit stats are data (UnitType), and --scenario=FILE starts from a binary scenario (scenario.h)
+// whose forces can be any mix of unit types and any size without costing anything at startup.
+// Unit types can be loaded from a table with --units=FILE (unit_types.h). Forces are runs of one
+// type each, and quiet battles attack with a kernel compiled for each run's combination of rules.
+// --simultaneous plays whole turns at once: both sides attack the previous turn's state and write the
+// next one, chunk by chunk on the thread pool (threadpool.h), with no locks. --turns=N (or the
+// answer to the turns question) ends the battle after N turns.
+// Statistics are kept per turn in a fixed-size series (turn_stats.h) instead of a list of hit counts
+// that grew every turn; --stats=FILE writes it out. Totals come from the soldiers' own hit counts.
+// Against big forces a side's attacks are rolled first and landed sorted by target, so applying
+// damage walks the defenders' records in order rather than missing cache on every blow.
+// Reinforcement waves (a scenario's wave lines, or --wave) join at the start of their turn and take
+// fallen soldiers' places first, so the forces only grow when the dead run out (reinforce()).
+// --sweep=M:B,... runs quiet battles of each matchup until its win rate and survivors are known to a
+// requested precision, instead of a fixed number of them. --cache=FILE keeps their results on disk
+// (outcome_cache.h), so asking again is instant and asking for more precision only adds battles.
+// --events=FILE records every attack in a compact columnar log (event_log.h), written on a thread of
+// its own. Quiet battles that record go through strikes rather than the kernels, which see every blow.
 
 #include <iostream>
 #include <vector>
@@ -11,324 +35,1144 @@
 #include <future>
 #include <mutex>
 #include <atomic>
-#include <cstdlib>
 #include <ctime>
-#include <numeric>  // For std::accumulate()
+#include <chrono>
 #include <condition_variable> // to syncronize threading
-#include <algorithm>    // for std::none_of()
+#include <algorithm>    // for std::all_of()
+#include <string>
+#include <fstream>
+#include <optional>
+#include <cstring>
+#include <array>
+#include <sstream>
+#include <iomanip>
+#include <unordered_map>
 
-std::mutex turn_mutex;
-std::condition_variable turn_cv;
-bool marine_turn = true;                // Flag to control who is attacking
+#include "battle_state.h"
+#include "scenario.h"
+#include "unit_types.h"
+#include "threadpool.h"
+#include "turn_stats.h"
+#include "sweep_stats.h"
+#include "outcome_cache.h"
+#include "event_log.h"
+#include "perf_counters.h"
+#include "profiled_mutex.h"
+
+ProfiledMutex turn_mutex("turn");      // reports its contention with -DBUGHUNT_METRICS=1
+std::condition_variable_any turn_cv;
 std::atomic<bool> game_over = false;    // Flag to control game duration
 
-class Soldier{
-    public:
-        int health;
-        int base_to_hit = 10;
+bool narrate = true;                    // blow-by-blow commentary, off with --quiet
 
-        // With atomic r/w, a thread always sees a consisent state of the var. Does not require locks.
-        std::atomic<bool> alive;
+// Soldiers are plain Combatant records in a BattleState (battle_state.h), so the whole battle can be
+// checkpointed and restored. What a soldier can do comes from its UnitType: Marines and Bugs by
+// default, or whatever a scenario (scenario.h) defines.
+void takeDamage(Combatant& self, const UnitType& type, int damage, bool piercing) {
+    self.wounds += damage;
+    if (self.wounds < type.maxHealth) return;
+    if ((type.rules & kOneTimeSave) && !self.saveUsed && !piercing) {
+        if (narrate) std::cout << type.name << "'s carapace protected it from a killing blow!\n";
+        self.wounds -= type.saveHeal; // Restore some health
+        self.saveUsed = 1;
+    } else {
+        self.dead = 1;
+        if (narrate) std::cout << type.name << " has fallen!\n";
+    }
+}
 
-        // Constructor to initialize attributes
-        // Needs to be initialized BEFORE functions pass it as an arg
-        Soldier() : health(100), alive(true) {}
-        
-        // Pure virtual method as each soldier will have a different attack
-        virtual void attack(Soldier* target) = 0;
+void attack(Combatant& self, const UnitType& type, Combatant& target, const UnitType& target_type, BattleRng& rng, SideTally& tally) {
+    if (narrate) std::cout << type.name << " attacks...\n";
+    int to_hit = rng.roll(10);
+    uint8_t save_used = target.saveUsed;
 
-        // Default one-shot
-        virtual void slay(Soldier* target) {
-            int damage = 100;  // Default damage
-            target->takeDamage(damage);
-            std::cout << "Critical hit! " << typeid(*target).name() << " takes " << damage << " damage.\n";
+    tally.attacks++;
+    if (to_hit > type.accuracy) {
+        if (narrate) std::cout << type.name << " hits!\n";
+        self.hits++;
+        tally.hits++;
+        if (to_hit == type.critRoll) {
+            bool piercing = type.rules & kPiercingCrit;
+            tally.crits++;
+            if (narrate) std::cout << type.name << (piercing ? " finds a gap in the armor!\n" : " scores a headshot!\n");
+            takeDamage(target, target_type, type.damage*2, piercing);    // Critical hit
+        } else {
+            takeDamage(target, target_type, type.damage, false);         // Standard hit
         }
+    } else {
+        if (narrate) std::cout << type.name << " misses...\n";
+    }
+    tally.saved += target.saveUsed != save_used;
+}
 
-        virtual void takeDamage(int damage) {
-            health -= damage;
-            if (health <= 0) {
-                alive = false;
-                std::cout << typeid(*this).name() << " has been killed.\n";
-            }
+// What the kernels need to know about the side being attacked: the stats of each of its groups,
+// and where the groups end
+struct DefenderTable {
+    struct Profile {
+        int32_t maxHealth;
+        int32_t saveHeal;
+        int32_t saves;      // 1 if the group has a one-time save
+    };
+    std::vector<Profile> profiles;
+    std::vector<uint64_t> ends;     // of every group but the last
+    bool anySaves = false;
+
+    DefenderTable(const std::vector<UnitType>& types, const std::vector<ForceGroup>& groups) {
+        for (const ForceGroup& group : groups) {
+            const UnitType& type = types[group.type];
+            int32_t saves = (type.rules & kOneTimeSave) ? 1 : 0;
+            profiles.push_back({type.maxHealth, type.saveHeal, saves});
+            anySaves |= saves != 0;
+            if (&group != &groups.back()) ends.push_back(group.end);
         }
+    }
 
-    // Virtual destructor
-    virtual ~Soldier() {} 
+    // Counts the boundaries below index instead of searching, so there's no branch to mispredict
+    size_t groupOf(uint64_t index) const {
+        size_t group = 0;
+        for (uint64_t end : ends) group += index >= end;
+        return group;
+    }
 };
 
-class Marine : public Soldier {
-    public:
-        int accuracy = 7;
-        int damage = 50;
-        int marine_hit = 0;
-
-        // Modifying the standard attack
-        void attack(Soldier* target) override {
-            std::cout << "Marine is shooting...\n";
-            int to_hit = rand() % 10 + 1;
-
-            if (to_hit > accuracy){
-                std::cout << "Marine hits!\n";
-                marine_hit++;
-                if (to_hit == base_to_hit) {
-                    slay(target);
-                } else {
-                    target->takeDamage(damage);     // Standard hit
-                }
-            } else {
-                std::cout << "Marine misses...\n";
-            }
-        }
+// Lands one attack on target, a soldier with the given profile: hit is 0 or 1, pierces is 1 for a
+// crit that ignores saves. The same rules as takeDamage(), without branches. Returns 1 on a kill,
+// and adds 1 to saved if the target's save turned the blow.
+template<bool DefendersSave>
+int32_t landBlow(Combatant& target, const DefenderTable::Profile& profile, int32_t hit, int32_t damage, int32_t pierces,
+                 uint64_t& saved_blows) {
+    target.wounds += hit * damage;
+    int32_t lethal = hit & (target.wounds >= profile.maxHealth);
+    int32_t saved = 0;
+    if constexpr (DefendersSave) {
+        saved = lethal & profile.saves & (target.saveUsed ^ 1) & (pierces ^ 1);
+        target.wounds -= saved * profile.saveHeal;
+        target.saveUsed |= saved;
+        saved_blows += uint64_t(saved);
+    }
+    uint8_t was_dead = target.dead;
+    target.dead |= lethal & (saved ^ 1);
+    return target.dead & (was_dead ^ 1);
+}
+
+// The quiet attack loop for one group of attackers, the same rules as attack() and takeDamage()
+// worked out with arithmetic. It is instantiated for each combination of the rules that would
+// otherwise be tested per attack, so a heterogeneous army costs one table lookup per attack more
+// than Marines against Bugs, and nothing branches on the dice. Only skipping the dead and logging
+// a kill are branches, and both are rare or predictable.
+template<bool Piercing, bool DefendersSave, bool OneDefenderGroup>
+void attackKernel(BattleState& state, const UnitType& type, const ForceGroup& group, MappedArray<Combatant>& attackers,
+                  MappedArray<Combatant>& defenders, const DefenderTable& table, bool marines_attacking, SideTally& tally) {
+    const int32_t accuracy = type.accuracy;
+    const int32_t damage = type.damage;
+    const int32_t crit_roll = type.critRoll;
+    const uint32_t victim_is_marine = marines_attacking ? 0u : 1u;
+    // Counted in locals so the loop doesn't store through tally
+    uint64_t attacks = 0, hit_count = 0, crit_count = 0, kill_count = 0, saved = 0;
+    for (uint32_t i = uint32_t(group.begin); i < group.end; ++i) {
+        Combatant& attacker = attackers[i];
+        if (attacker.dead) continue;
+        uint32_t t = uint32_t(state.rng.below(defenders.size()));
+        Combatant& target = defenders[t];
+        const DefenderTable::Profile& profile = table.profiles[OneDefenderGroup ? 0 : table.groupOf(t)];
 
-        void slay(Soldier* target) override {
-            std::cout << "Marine scores a headshot!\n";
-            target->takeDamage(damage*2);    // Critical hit
+        int32_t to_hit = state.rng.roll(10);
+        int32_t hit = to_hit > accuracy;
+        int32_t crit = hit & (to_hit == crit_roll);
+        attacker.hits += hit;
+        hit_count += uint64_t(hit);
+        crit_count += uint64_t(crit);
+        // double damage on a crit
+        if (landBlow<DefendersSave>(target, profile, hit, damage << crit, Piercing ? crit : 0, saved)) {
+            attacker.kills++;
+            ++kill_count;
+            state.kills.push_back({state.turn, i, t, victim_is_marine, attacker.generation, target.generation});
         }
+        ++attacks;
+    }
+    tally.add({attacks, hit_count, crit_count, kill_count, saved});
+}
+
+using AttackKernel = void (*)(BattleState&, const UnitType&, const ForceGroup&, MappedArray<Combatant>&,
+                              MappedArray<Combatant>&, const DefenderTable&, bool, SideTally&);
+
+AttackKernel pickKernel(bool piercing, bool defenders_save, bool one_defender_group) {
+    static constexpr AttackKernel kernels[2][2][2] = {
+        {{attackKernel<false, false, false>, attackKernel<false, false, true>},
+         {attackKernel<false, true, false>, attackKernel<false, true, true>}},
+        {{attackKernel<true, false, false>, attackKernel<true, false, true>},
+         {attackKernel<true, true, false>, attackKernel<true, true, true>}},
+    };
+    return kernels[piercing][defenders_save][one_defender_group];
+}
+
+// Against a big force every blow landed in attack order is a cache miss on a random soldier. Past
+// kSortedStrikesFrom defenders (1MiB of records) the attacks are rolled first, as strikes, and
+// then landed in target order, so damage streams through the defenders' records instead.
+// The sort is stable, so blows on one soldier land in the order they were rolled and the battle
+// plays out exactly as if they had landed one by one; only the kill ledger is in target order.
+constexpr uint64_t kSortedStrikesFrom = 65536;
+
+struct Strike {
+    uint32_t attacker;
+    uint32_t target;
+    int32_t damage;
+    int32_t pierces;    // a crit that ignores saves
 };
 
-class Bug : public Soldier {
-    public:
-        int accuracy = 8;
-        int damage = 50;
-        bool carapace = true;
-        int bug_hit = 0;
-
-        void attack(Soldier* target) override {
-            std::cout << "Bug attacks with its claws...\n";
-            int to_hit = rand() % 10 + 1;
-
-            if (to_hit > accuracy) {
-                std::cout << "Bug hits!\n";
-                bug_hit++;
-                if (to_hit == base_to_hit) {
-                    slay(target);
-                } else {
-                    target->takeDamage(damage);
-                }
-            } else {
-            std::cout << "Bug misses...\n";
-            }
+// Buffers reused from turn to turn
+struct StrikeBuffers {
+    std::vector<Strike> strikes;
+    std::vector<Strike> scratch;
+    std::vector<KillRecord> kills;
+};
+
+// Rolls the attacks of soldiers [begin, end), all of one type, on defender_count defenders. Who is
+// alive is read from current and hits are added to next, which is the same array unless turns are
+// simultaneous. Hits are appended to strikes, and the rolls are the same as attackKernel's. With
+// events, every attack is recorded there too, side being kBugsAttacking or 0.
+void rollStrikes(const UnitType& type, const Combatant* current, Combatant* next, uint32_t begin, uint32_t end,
+                 uint64_t defender_count, BattleRng& rng, std::vector<Strike>& strikes, SideTally& tally,
+                 uint32_t turn, uint8_t side, std::vector<BattleEvent>* events) {
+    const int32_t accuracy = type.accuracy;
+    const int32_t damage = type.damage;
+    const int32_t crit_roll = type.critRoll;
+    const int32_t piercing = (type.rules & kPiercingCrit) ? 1 : 0;
+    uint64_t attacks = 0, hit_count = 0, crit_count = 0;
+    for (uint32_t i = begin; i < end; ++i) {
+        if (current[i].dead) continue;
+        uint32_t t = uint32_t(rng.below(defender_count));
+        int32_t to_hit = rng.roll(10);
+        int32_t hit = to_hit > accuracy;
+        int32_t crit = hit & (to_hit == crit_roll);
+        next[i].hits += hit;
+        hit_count += uint64_t(hit);
+        crit_count += uint64_t(crit);
+        if (hit) strikes.push_back({i, t, damage << crit, piercing & crit});
+        if (events) events->push_back({turn, i, t, hit * (damage << crit), uint8_t((hit + crit) | side)});
+        ++attacks;
+    }
+    tally.add({attacks, hit_count, crit_count, 0, 0});
+}
+
+// Stable LSD radix sort by target, 11 bits a pass and only as many passes as target_count needs:
+// two for up to 4M defenders
+void sortByTarget(std::vector<Strike>& strikes, std::vector<Strike>& scratch, uint64_t target_count) {
+    constexpr unsigned kBits = 11;
+    constexpr uint32_t kMask = (1u << kBits) - 1;
+    std::array<size_t, size_t(1) << kBits> counts;
+    scratch.resize(strikes.size());
+    for (unsigned shift = 0; shift < 32 && ((target_count - 1) >> shift) != 0; shift += kBits) {
+        counts.fill(0);
+        for (const Strike& strike : strikes) counts[(strike.target >> shift) & kMask]++;
+        size_t start = 0;
+        for (size_t& count : counts) {
+            size_t n = count;
+            count = start;
+            start += n;
         }
+        for (const Strike& strike : strikes) scratch[counts[(strike.target >> shift) & kMask]++] = strike;
+        strikes.swap(scratch);
+    }
+}
 
-        void slay(Soldier* target) override {
-            std::cout << "Bug finds a gap in the Marine's armor!\n";
-            target->health -= (damage*2);
+// Lands strikes on targets, prefetching the records a few strikes ahead. Sorted by target, targets
+// only move forward, so the group (and profile) is tracked instead of looked up. Kills go into
+// kills, for the caller to credit and to fill in the killer's generation. With events, kills and
+// saves are recorded there as follow-ups to the attacks rollStrikes() recorded.
+template<bool DefendersSave, bool Sorted>
+void landStrikes(const std::vector<Strike>& strikes, MappedArray<Combatant>& targets, const DefenderTable& table,
+                       uint32_t turn, uint32_t victim_is_marine, std::vector<KillRecord>& kills, uint64_t& saved,
+                       std::vector<BattleEvent>* events) {
+    const uint8_t side = victim_is_marine ? kBugsAttacking : 0;
+    constexpr size_t kAhead = 16;
+    size_t group = 0;
+    for (size_t k = 0; k < strikes.size(); ++k) {
+        if (k + kAhead < strikes.size()) __builtin_prefetch(&targets[strikes[k + kAhead].target], 1);
+        const Strike& strike = strikes[k];
+        if constexpr (Sorted) {
+            while (group < table.ends.size() && strike.target >= table.ends[group]) ++group;
+        } else {
+            group = table.groupOf(strike.target);
         }
-        void takeDamage(int damage) override {
-            health -= damage;
-            if (health <= 0 && carapace) {
-                std::cout << "Bug's carapace protected it from a killing blow!\n";
-                health += 50; // Restore some health
-                carapace = false;
-            } else if (health <= 0) {
-                alive = false;
-                std::cout << "The bug has fallen!\n";
-            }
+        uint64_t saved_before = saved;
+        if (landBlow<DefendersSave>(targets[strike.target], table.profiles[group], 1, strike.damage, strike.pierces, saved)) {
+            kills.push_back({turn, strike.attacker, strike.target, victim_is_marine, 0, targets[strike.target].generation});
+            if (events) events->push_back({turn, strike.attacker, strike.target, strike.damage, uint8_t(kKill | side)});
         }
-};
+        if (events && saved != saved_before) {
+            events->push_back({turn, strike.attacker, strike.target, strike.damage, uint8_t(kSaved | side)});
+        }
+    }
+}
 
-void marineAttack(std::vector<std::unique_ptr<Marine>>& marine_force, std::vector<std::unique_ptr<Bug>>& bug_force, std::vector<int>& marine_hits) {
-    for (auto& marine : marine_force) {
-        if (!marine->alive) continue;
-        Soldier* target = bug_force[rand() % bug_force.size()].get();
-        marine->attack(target);
-        marine_hits.push_back(marine->marine_hit);  // Store individual hits
+// landStrikes() made for the defenders' rules, sorting the strikes by target first on big forces
+void landAll(StrikeBuffers& buffers, MappedArray<Combatant>& targets, const DefenderTable& table, uint32_t turn,
+             uint32_t victim_is_marine, uint64_t& saved, std::vector<BattleEvent>* events) {
+    if (targets.size() < kSortedStrikesFrom) {
+        if (table.anySaves) {
+            landStrikes<true, false>(buffers.strikes, targets, table, turn, victim_is_marine, buffers.kills, saved, events);
+        } else {
+            landStrikes<false, false>(buffers.strikes, targets, table, turn, victim_is_marine, buffers.kills, saved, events);
+        }
+        return;
+    }
+    sortByTarget(buffers.strikes, buffers.scratch, targets.size());
+    if (table.anySaves) {
+        landStrikes<true, true>(buffers.strikes, targets, table, turn, victim_is_marine, buffers.kills, saved, events);
+    } else {
+        landStrikes<false, true>(buffers.strikes, targets, table, turn, victim_is_marine, buffers.kills, saved, events);
     }
 }
 
-void bugAttack(std::vector<std::unique_ptr<Bug>>& bug_force, std::vector<std::unique_ptr<Marine>>& marine_force, std::vector<int>& bug_hits) {
-    for (auto& bug : bug_force) {
-        if (!bug->alive) continue;
-        Soldier* target = marine_force[rand() % marine_force.size()].get();
-        bug->attack(target);
-        bug_hits.push_back(bug->bug_hit);   // Store individual hit
+// Every living soldier of one side attacks a random enemy. Kills go into the ledger, what the side
+// did into tally, and every attack into events if it's given.
+void sideAttack(BattleState& state, bool marines_attacking, SideTally& tally, StrikeBuffers& buffers,
+                std::vector<BattleEvent>* events = nullptr) {
+    MappedArray<Combatant>& attackers = marines_attacking ? state.marines : state.bugs;
+    MappedArray<Combatant>& defenders = marines_attacking ? state.bugs : state.marines;
+    const std::vector<ForceGroup>& attacker_groups = marines_attacking ? state.marineGroups : state.bugGroups;
+    const std::vector<ForceGroup>& defender_groups = marines_attacking ? state.bugGroups : state.marineGroups;
+
+    const uint8_t side = marines_attacking ? 0 : kBugsAttacking;
+    // Landing blows in attack order after rolling them all plays out the same as the kernels, as
+    // the attackers' records aren't touched by the blows
+    if (!narrate && (defenders.size() >= kSortedStrikesFrom || events)) {
+        DefenderTable table(state.types, defender_groups);
+        buffers.strikes.clear();
+        buffers.kills.clear();
+        for (const ForceGroup& group : attacker_groups) {
+            rollStrikes(state.types[group.type], attackers.data(), attackers.data(), uint32_t(group.begin), uint32_t(group.end),
+                        defenders.size(), state.rng, buffers.strikes, tally, state.turn, side, events);
+        }
+        landAll(buffers, defenders, table, state.turn, marines_attacking ? 0u : 1u, tally.saved, events);
+        for (KillRecord& kill : buffers.kills) {
+            attackers[kill.killer].kills++;
+            kill.killerGeneration = attackers[kill.killer].generation;
+            state.kills.push_back(kill);
+        }
+        tally.kills += buffers.kills.size();
+        return;
+    }
+
+    // Each group of one unit type gets the kernel made for its rules
+    if (!narrate) {
+        DefenderTable table(state.types, defender_groups);
+        for (const ForceGroup& group : attacker_groups) {
+            const UnitType& type = state.types[group.type];
+            AttackKernel kernel = pickKernel(type.rules & kPiercingCrit, table.anySaves, table.profiles.size() == 1);
+            kernel(state, type, group, attackers, defenders, table, marines_attacking, tally);
+        }
+        return;
+    }
+
+    // Narrated, one soldier at a time
+    for (const ForceGroup& group : attacker_groups) {
+        const UnitType& type = state.types[group.type];
+        for (uint32_t i = uint32_t(group.begin); i < group.end; ++i) {
+            Combatant& attacker = attackers[i];
+            if (attacker.dead) continue;
+            uint32_t t = uint32_t(state.rng.below(defenders.size()));
+            Combatant& target = defenders[t];
+            bool was_dead = target.dead;
+            SideTally before = tally;
+            attack(attacker, type, target, state.types[groupOf(defender_groups, t).type], state.rng, tally);
+            int32_t crit = tally.crits != before.crits;
+            int32_t damage = tally.hits != before.hits ? type.damage << crit : 0;
+            if (events) {
+                events->push_back({state.turn, i, t, damage, uint8_t((damage ? kHit + crit : kMiss) | side)});
+                if (tally.saved != before.saved) events->push_back({state.turn, i, t, damage, uint8_t(kSaved | side)});
+            }
+            if (target.dead && !was_dead) {
+                attacker.kills++;
+                tally.kills++;
+                state.kills.push_back({state.turn, i, t, marines_attacking ? 0u : 1u, attacker.generation, target.generation});
+                if (events) events->push_back({state.turn, i, t, damage, uint8_t(kKill | side)});
+            }
+        }
     }
 }
 
-std::pair<int, int> gameLoop(std::vector<std::unique_ptr<Marine>>& marine_force, std::vector<std::unique_ptr<Bug>>& bug_force) {
-    std::atomic<bool> game_over = false;
-    size_t marine_count = marine_force.size();
-    size_t bug_count = bug_force.size();
-    int sleep_time = 100;
-    int total_marine_hits = 0;
-    int total_bug_hits = 0;
-    int turn_number = 1;
+void marineAttack(BattleState& state, SideTally& marines, StrikeBuffers& buffers, std::vector<BattleEvent>* events = nullptr) {
+    sideAttack(state, true, marines, buffers, events);
+}
 
-    // Tracking dead soldiers for stats
-    std::vector<int> marine_hits;  // Preserve marine hit counts
-    std::vector<int> bug_hits;     // Preserve bug hit counts
+void bugAttack(BattleState& state, SideTally& bugs, StrikeBuffers& buffers, std::vector<BattleEvent>* events = nullptr) {
+    sideAttack(state, false, bugs, buffers, events);
+}
+
+size_t countAlive(const MappedArray<Combatant>& force) {
+    return std::count_if(force.begin(), force.end(), [](const Combatant& soldier) { return !soldier.dead; });
+}
 
-    std::cout << "This fight is between " << marine_count << " Marines and " << bug_count << " Bugs!\n"; 
-    std::cout << "Turn 1 begins!\n";
+// Simultaneous turns: both sides attack at once. Every attack reads this turn's records and the
+// results go into a second buffer that becomes the next turn's, so attacks never see each other's
+// damage and need no locks. Attackers are cut into chunks that run in parallel on the pool. Each
+// chunk copies its own attackers into the next buffer and rolls its attacks with its own RNG stream,
+// seeded from the battle RNG and the chunk's number. Hits become strikes, and each side's strikes
+// are then landed by one task, in chunk order (sorted by target, stably, on big forces). So a seed
+// plays out the same on any number of threads.
 
-    // Combat lambda for turn based combat 
-    auto battle = [&game_over, &marine_count, &bug_count, &marine_hits, &bug_hits](Soldier* attacker, Soldier* defender, bool is_marine_attacking) {
-        if(!attacker->alive || !defender->alive) return;
+struct AttackChunk {
+    bool marines;       // the attackers are Marines
+    uint32_t type;
+    uint32_t begin;
+    uint32_t end;
+    std::vector<Strike> strikes;
+    SideTally tally;    // attacks, hits and crits; kills and saves are counted when the strikes land
+    std::vector<BattleEvent> events;
+};
 
-        attacker->attack(defender);
-        /*
-        if (is_marine_attacking) {
-            //dynamic_cast ensures the attacker is correctly ID'ed as a Marine or Bug
-            Marine* marine = dynamic_cast<Marine*>(attacker);
+class SimultaneousTurns {
+public:
+    static constexpr uint32_t kChunk = 16384;
 
-            if (marine) {
-                marine_hits.push_back(marine->marine_hit);
+    SimultaneousTurns(const BattleState& state, ThreadPool& pool) :
+        pool(pool), next_marines(state.marines.size()), next_bugs(state.bugs.size()) {
+        for (bool marines : {true, false}) {
+            for (const ForceGroup& group : marines ? state.marineGroups : state.bugGroups) {
+                for (uint64_t begin = group.begin; begin < group.end; begin += kChunk) {
+                    AttackChunk chunk;
+                    chunk.marines = marines;
+                    chunk.type = group.type;
+                    chunk.begin = uint32_t(begin);
+                    chunk.end = uint32_t(std::min<uint64_t>(group.end, begin + kChunk));
+                    chunks.push_back(std::move(chunk));
+                }
             }
-        } else {
-            Bug* bug = dynamic_cast<Bug*>(attacker);
-            if (bug) {
-                bug_hits.push_back(bug->bug_hit);
+        }
+    }
+
+    // Plays one turn, adding what each side did to its tally and, if given, every attack to events:
+    // the chunks' attacks in chunk order, then the kills and saves on the Bugs and on the Marines
+    void turn(BattleState& state, SideTally& marine_tally, SideTally& bug_tally, std::vector<BattleEvent>* events = nullptr) {
+        uint64_t turn_seed = state.rng.next();
+
+        pool.parallelFor(0, chunks.size(), [&](size_t c) {
+            AttackChunk& chunk = chunks[c];
+            const MappedArray<Combatant>& current = chunk.marines ? state.marines : state.bugs;
+            MappedArray<Combatant>& next = chunk.marines ? next_marines : next_bugs;
+            size_t defenders = chunk.marines ? state.bugs.size() : state.marines.size();
+            const UnitType& type = state.types[chunk.type];
+            BattleRng rng{BattleRng{turn_seed ^ (uint64_t(c) << 32)}.next()};
+
+            std::memcpy(&next[chunk.begin], &current[chunk.begin], (chunk.end - chunk.begin) * sizeof(Combatant));
+            chunk.strikes.clear();
+            chunk.tally = SideTally();
+            chunk.events.clear();
+            rollStrikes(type, current.data(), next.data(), chunk.begin, chunk.end, defenders, rng, chunk.strikes, chunk.tally,
+                        state.turn, chunk.marines ? 0 : kBugsAttacking, events ? &chunk.events : nullptr);
+        }, 1);
+
+        // One task per side lands the strikes on it. Kills are credited once both are done, because
+        // the killers' records belong to the other task.
+        uint64_t saved[2] = {0, 0};
+        pool.parallelFor(0, 2, [&](size_t side) {
+            bool on_bugs = side == 0;
+            MappedArray<Combatant>& targets = on_bugs ? next_bugs : next_marines;
+            DefenderTable table(state.types, on_bugs ? state.bugGroups : state.marineGroups);
+            StrikeBuffers& batch = buffers[side];
+            batch.strikes.clear();
+            batch.kills.clear();
+            for (const AttackChunk& chunk : chunks) {
+                if (chunk.marines == on_bugs) batch.strikes.insert(batch.strikes.end(), chunk.strikes.begin(), chunk.strikes.end());
             }
+            landed[side].clear();
+            landAll(batch, targets, table, state.turn, on_bugs ? 0u : 1u, saved[side], events ? &landed[side] : nullptr);
+        }, 1);
+
+        if (events) {
+            for (const AttackChunk& chunk : chunks) events->insert(events->end(), chunk.events.begin(), chunk.events.end());
+            for (const std::vector<BattleEvent>& side : landed) events->insert(events->end(), side.begin(), side.end());
+        }
+
+        for (const AttackChunk& chunk : chunks) {
+            (chunk.marines ? marine_tally : bug_tally).add(chunk.tally);
         }
-        */
-        if (!defender->alive) {
-            if (is_marine_attacking) {
-                --bug_count;
-                std::cout << bug_count << " bugs remain!\n";
-                if (bug_count == 0) game_over = true;
-            } else {                    
-                --marine_count;
-                std::cout << marine_count << " Marines remain!\n";
-                if (marine_count == 0) game_over = true;
+        marine_tally.kills += buffers[0].kills.size();
+        marine_tally.saved += saved[0];
+        bug_tally.kills += buffers[1].kills.size();
+        bug_tally.saved += saved[1];
+        for (StrikeBuffers& side : buffers) {
+            for (KillRecord& kill : side.kills) {
+                Combatant& killer = (kill.marineKilled ? next_bugs : next_marines)[kill.killer];
+                killer.kills++;
+                kill.killerGeneration = killer.generation;
+                state.kills.push_back(kill);
             }
         }
-    };
-    
+
+        std::swap(state.marines, next_marines);
+        std::swap(state.bugs, next_bugs);
+    }
+
+private:
+    ThreadPool& pool;
+    MappedArray<Combatant> next_marines;
+    MappedArray<Combatant> next_bugs;
+    std::vector<AttackChunk> chunks;
+    StrikeBuffers buffers[2];   // strikes on the Bugs, on the Marines
+    std::vector<BattleEvent> landed[2];
+};
+
+// Where and how often to checkpoint the battle. No path, no checkpoints.
+struct CheckpointOptions {
+    std::string path;
+    uint32_t every = 10;    // turns
+};
+
+// How the battle is fought
+struct BattleOptions {
+    uint32_t turn_max = 0;          // 0: until one side is wiped out
+    ThreadPool* pool = nullptr;     // set: simultaneous turns on this pool
+    size_t stats_points = 256;      // most entries the turn series keeps
+    EventLogWriter* events = nullptr;   // set: every attack is recorded in this log
+};
+
+// Whole-battle totals, counted from the soldiers themselves
+struct BattleTotals {
+    uint64_t marine_hits = 0;
+    uint64_t bug_hits = 0;
+};
+
+BattleTotals gameLoop(BattleState& state, const CheckpointOptions& checkpoint, const BattleOptions& options, TurnSeries& series) {
+    std::atomic<bool> game_over = false;
+    int sleep_time = 100;
+    size_t attack_phase = PerfPhases::instance().phase("attack");
+    size_t stats_phase = PerfPhases::instance().phase("stats");
+
+    // Soldiers standing, kept up to date from the kill counts rather than by counting every turn
+    uint64_t marines_alive = countAlive(state.marines);
+    uint64_t bugs_alive = countAlive(state.bugs);
+    TurnStats this_turn;
+    this_turn.firstTurn = this_turn.lastTurn = state.turn;
+
+    std::cout << "This fight is between " << marines_alive << " Marines and " << bugs_alive << " Bugs!\n"; 
+    std::cout << "Turn " << state.turn << " begins!\n";
+
+    StrikeBuffers strike_buffers;
+    // Each half-turn's events go to the log's thread as one batch
+    std::vector<BattleEvent> turn_events;
+    std::vector<BattleEvent>* recording = options.events ? &turn_events : nullptr;
+    std::optional<SimultaneousTurns> simultaneous;
+    if (options.pool) simultaneous.emplace(state, *options.pool);
+
     while (!game_over) {
-        std::unique_lock<std::mutex> lock(turn_mutex);
+        if (options.turn_max && state.turn > options.turn_max) {
+            std::cout << "Neither side broke after " << options.turn_max << " turns. The battle is called off.\n";
+            break;
+        }
+        std::unique_lock<ProfiledMutex> lock(turn_mutex);
 
-        if (marine_turn) {
-            marineAttack(marine_force, bug_force, marine_hits);
+        // Waves arrive at the start of their turn
+        bool reinforced = false;
+        while (!state.reinforcements.empty() && state.reinforcements.front().turn <= state.turn) {
+            Reinforcement wave = state.reinforcements.front();
+            state.reinforcements.erase(state.reinforcements.begin());
+            uint64_t reused = reinforce(state, wave);
+            (wave.bugs ? bugs_alive : marines_alive) += wave.count;
+            std::cout << "Turn " << state.turn << ": " << wave.count << " " << state.types[wave.type].name << " reinforcements join the "
+                      << (wave.bugs ? "Bugs" : "Marines") << " (" << reused << " in fallen soldiers' places).\n";
+            reinforced = true;
         }
-        if (!marine_turn) {
-            bugAttack(bug_force, marine_force, bug_hits);
+        // The forces may have grown, so the next-turn buffers and chunks are laid out again
+        if (reinforced && simultaneous) simultaneous.emplace(state, *options.pool);
+
+        {
+            PerfScope scope(attack_phase);
+            if (simultaneous) {
+                simultaneous->turn(state, this_turn.marines, this_turn.bugs, recording);
+            } else if (state.marineTurn) {
+                marineAttack(state, this_turn.marines, strike_buffers, recording);
+            } else {
+                bugAttack(state, this_turn.bugs, strike_buffers, recording);
+            }
+        }
+        // A simultaneous turn is one volley from every soldier standing on each side, whoever was
+        // picked to go first. Nothing is counted again, so a second volley would go unnoticed.
+        if (simultaneous && (this_turn.marines.attacks != marines_alive || this_turn.bugs.attacks != bugs_alive)) {
+            throw std::logic_error("turn " + std::to_string(state.turn) + ": " + std::to_string(this_turn.marines.attacks)
+                                   + " Marine and " + std::to_string(this_turn.bugs.attacks) + " Bug attacks from "
+                                   + std::to_string(marines_alive) + " Marines and " + std::to_string(bugs_alive) + " Bugs");
         }
+        if (recording) options.events->submit(turn_events);
     
         // Check if the game is over
-        // none_of checks if elements in a given range satisfy a specific condition eg soldier->alive
-        // std::atomics do not permit copying, which this lambda is attempting. Thus, .load() is necessary to read the value directly.
-        if (std::none_of(bug_force.begin(), bug_force.end(), [](const auto& bug) { return bug->alive.load(); })) {
-            std::cout << "Marines are victorious!\n";
-            game_over = true;
-        } else if (std::none_of(marine_force.begin(), marine_force.end(), [](const auto& marine) { return marine->alive.load(); })) {
-            std::cout << "Bugs triumph!\n";
-            game_over = true;
-        }
-
-        // Toggle turn
-        marine_turn = !marine_turn;
-        if (marine_turn) {
-            ++turn_number;
-            std::cout << "\nTurn " << turn_number << " begins!\n\n";
+        {
+            PerfScope scope(stats_phase);
+            bool bugs_gone = this_turn.marines.kills >= bugs_alive;
+            bool marines_gone = this_turn.bugs.kills >= marines_alive;
+            if (bugs_gone && marines_gone) {
+                std::cout << "Nobody is left standing!\n";     // only possible when both sides strike at once
+                game_over = true;
+            } else if (bugs_gone) {
+                std::cout << "Marines are victorious!\n";
+                game_over = true;
+            } else if (marines_gone) {
+                std::cout << "Bugs triumph!\n";
+                game_over = true;
+            }
+        }
+
+        // Toggle turn. Simultaneous turns are whole turns.
+        bool new_turn = true;
+        if (!simultaneous) {
+            state.marineTurn = !state.marineTurn;
+            new_turn = state.marineTurn;
+        }
+        if (new_turn || game_over) {
+            bugs_alive -= this_turn.marines.kills;
+            marines_alive -= this_turn.bugs.kills;
+            this_turn.marinesAlive = marines_alive;
+            this_turn.bugsAlive = bugs_alive;
+            series.record(this_turn);
+            this_turn = TurnStats();
+            this_turn.firstTurn = this_turn.lastTurn = state.turn + 1;
+        }
+        if (new_turn) {
+            ++state.turn;
+            if (narrate && simultaneous && !game_over) {
+                std::cout << marines_alive << " Marines and " << bugs_alive << " Bugs still stand.\n";
+            }
+            if (narrate) std::cout << "\nTurn " << state.turn << " begins!\n\n";
         }
         turn_cv.notify_all();
         lock.unlock();
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-    }
 
-    // Sum hits from active Marines and Bugs
-    // Don't want to modify the object (soldier) we're referencing, so this is a const
-    // Also better to reinforce std::unique_ptr is a non-copyable element
-    for (const auto& marine : marine_force) {
-        if (marine->alive) {
-            total_marine_hits += marine->marine_hit;
-        }
-    }
-    std::cout << "\nHits from living Marines: " << total_marine_hits << "\n";
-    
-    for (const auto& bug : bug_force) {
-        if (bug->alive) {
-            total_bug_hits += bug->bug_hit;
+        // Checkpoint between turns, so a restored battle starts cleanly on the next one
+        if (!game_over && new_turn && !checkpoint.path.empty() && state.turn % checkpoint.every == 0) {
+            auto start = std::chrono::steady_clock::now();
+            saveSnapshot(state, checkpoint.path);
+            std::cout << "Checkpoint of turn " << state.turn << " saved to " << checkpoint.path << " in "
+                      << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << "ms.\n";
         }
+        if (narrate) std::this_thread::sleep_for(std::chrono::milliseconds(sleep_time));
     }
 
-    std::cout << "\nHits from living Bugs: " << total_bug_hits << "\n";
+    // Every soldier keeps its hit count, dead or alive, so the totals are one pass over the records
+    // plus the hits of fallen soldiers whose places went to reinforcements
+    BattleTotals totals;
+    totals.marine_hits = state.retiredHits[0];
+    totals.bug_hits = state.retiredHits[1];
+    uint64_t fallen_marine_hits = state.retiredHits[0];
+    uint64_t fallen_bug_hits = state.retiredHits[1];
+    for (const Combatant& marine : state.marines) {
+        totals.marine_hits += marine.hits;
+        if (marine.dead) fallen_marine_hits += marine.hits;
+    }
+    for (const Combatant& bug : state.bugs) {
+        totals.bug_hits += bug.hits;
+        if (bug.dead) fallen_bug_hits += bug.hits;
+    }
 
-    // Add stats from dead soldiers
-    //std::cout << "\nHits from dead Marines: " << std::accumulate(marine_hits.begin(), marine_hits.end(), 0) << "\n";
-    //std::cout << "\nHits from dead Bugs: " << std::accumulate(bug_hits.begin(), bug_hits.end(), 0) << "\n";
-    
-    total_marine_hits += std::accumulate(marine_hits.begin(), marine_hits.end(), 0);
-    total_bug_hits += std::accumulate(bug_hits.begin(), bug_hits.end(), 0);
+    std::cout << "\nHits from living Marines: " << totals.marine_hits - fallen_marine_hits << "\n";
+    std::cout << "\nHits from living Bugs: " << totals.bug_hits - fallen_bug_hits << "\n";
+    std::cout << "\nHits from fallen Marines: " << fallen_marine_hits << "\n";
+    std::cout << "\nHits from fallen Bugs: " << fallen_bug_hits << "\n";
+    std::cout << "\nTotal Marine hits: " << totals.marine_hits << "\n";
+    std::cout << "\nTotal Bug hits: " << totals.bug_hits << "\n";
+    std::cout << "\n" << state.kills.size() << " kills in the ledger.\n";
 
-    std::cout << "\nTotal Marine hits: " << total_marine_hits << "\n";
-    std::cout << "\nTotal Bug hits: " << total_bug_hits << "\n";
+    // Turns sleep between each other, so rate the attacks against the attack phase's own time
+    if (PerfPhases::instance().enabled()) {
+        const TurnStats& fought = series.totals();
+        uint64_t attacks = fought.marines.attacks + fought.bugs.attacks;
+        PerfCounts attack_counts = PerfPhases::instance().total(attack_phase);
+        std::cout << "\n" << attacks << " attacks";
+        if (attack_counts.ns > 0) std::cout << " (" << static_cast<uint64_t>(attacks / (attack_counts.ns / 1e9)) << " attacks/s)";
+        std::cout << "\n";
+        PerfPhases::instance().report(std::cout, "turns engine");
+    }
 
-    return {total_marine_hits, total_bug_hits};
+    return totals;
 }
 
-void postProcessing(int total_marine_hits, int total_bug_hits) {
+void postProcessing(const BattleTotals& totals, const TurnSeries& series) {
+    const TurnStats& fought = series.totals();
     std::cout << "\n\nPost Fight Stats!\n\n";
-    std::cout << "Total Marine hits this fight: " << total_marine_hits << ".\n";
-    std::cout << "Total Bug hits this fight: " << total_bug_hits << ".\n";
+    std::cout << "Total Marine hits this fight: " << totals.marine_hits << ".\n";
+    std::cout << "Total Bug hits this fight: " << totals.bug_hits << ".\n";
+    std::cout << "Over " << series.turnsRecorded() << " turns the Marines landed " << fought.marines.crits << " crits and the Bugs "
+              << fought.bugs.crits
+              << ". Saves turned " << fought.marines.saved << " killing blows from Marines and " << fought.bugs.saved << " from Bugs.\n";
 
-    if (total_marine_hits > total_bug_hits) {
+    if (totals.marine_hits > totals.bug_hits) {
         std::cout << "The Marines had superior accuracy this battle!\n";
-    } else if (total_bug_hits > total_marine_hits) {
+    } else if (totals.bug_hits > totals.marine_hits) {
         std::cout << "The Bugs were more effective in landing hits!\n";
     } else {
         std::cout << "It's a draw in terms of hit counts!\n";
     }
 }
 
-int main() {
+// Sweeps fight each configuration quietly, over and over, and stop as soon as its estimates are
+// known to within ±precision (sweep_stats.h), so a lopsided matchup is settled in a few hundred
+// battles and the budget goes to the close ones.
+struct SweepOptions {
+    double precision = 0.01;        // half-width of the intervals, on rates and fractions of a force
+    double confidence = 0.95;
+    uint64_t min_battles = 32;      // samples before trusting an interval; an antithetic pair is one
+    uint64_t max_battles = 100000;  // per configuration, precise or not
+    uint32_t turn_max = 0;
+    bool common_random_numbers = false;     // battle i of every configuration on the same random stream
+    bool antithetic = false;                // every battle alongside its mirror image
+    std::string cache_path;                 // outcome cache (outcome_cache.h), none if empty
+    bool distributions = false;             // print the survivor histograms too
+};
+
+// Bump when a change to the rules changes how battles come out, so cached sweep results are dropped
+constexpr uint32_t kSweepEngineVersion = 1;
+
+// MARINES:BUGS of the registry's Marines and Bugs, or a scenario file
+struct SweepConfig {
+    std::string label;
+    uint64_t marines = 0;
+    uint64_t bugs = 0;
+    std::string scenario_path;
+
+    // The sweep replaces the RNG, so a scenario's own seed doesn't make every battle the same one
+    BattleState opening(const std::vector<UnitType>& types, uint64_t seed) const {
+        if (!scenario_path.empty()) return loadScenario(scenario_path, seed);
+        BattleState state(marines, bugs, seed);
+        state.types = types;
+        return state;
+    }
+};
+
+// The battle without a word said, as the sweep needs it. With a half_turn_key every half-turn draws from
+// its own numbered stream of that family, keeping the RNG's antithetic flag, so two configurations on
+// the same key only drift apart in their luck within a half-turn, not for the rest of the battle.
+BattleOutcome fightQuietly(BattleState& state, uint32_t turn_max, StrikeBuffers& buffers,
+                           std::optional<uint64_t> half_turn_key = std::nullopt) {
+    uint64_t half_turn = 0;
+    uint64_t marines_alive = countAlive(state.marines);
+    uint64_t bugs_alive = countAlive(state.bugs);
+    uint64_t marines_fought = marines_alive;
+    uint64_t bugs_fought = bugs_alive;
+    while (marines_alive && bugs_alive && (!turn_max || state.turn <= turn_max)) {
+        while (!state.reinforcements.empty() && state.reinforcements.front().turn <= state.turn) {
+            Reinforcement wave = state.reinforcements.front();
+            state.reinforcements.erase(state.reinforcements.begin());
+            reinforce(state, wave);
+            (wave.bugs ? bugs_alive : marines_alive) += wave.count;
+            (wave.bugs ? bugs_fought : marines_fought) += wave.count;
+        }
+        if (half_turn_key) {
+            bool antithetic = state.rng.antithetic;
+            state.rng = BattleRng::keyed(*half_turn_key, half_turn++);
+            state.rng.antithetic = antithetic;
+        }
+        SideTally tally;
+        if (state.marineTurn) {
+            marineAttack(state, tally, buffers);
+            bugs_alive -= tally.kills;
+        } else {
+            bugAttack(state, tally, buffers);
+            marines_alive -= tally.kills;
+        }
+        state.marineTurn = !state.marineTurn;
+        if (state.marineTurn) ++state.turn;
+    }
+
+    BattleOutcome outcome;
+    if (marines_alive && !bugs_alive) outcome.winner = BattleOutcome::kMarines;
+    if (bugs_alive && !marines_alive) outcome.winner = BattleOutcome::kBugs;
+    outcome.marinesLeft = marines_fought ? double(marines_alive) / double(marines_fought) : 0;
+    outcome.bugsLeft = bugs_fought ? double(bugs_alive) / double(bugs_fought) : 0;
+    outcome.turns = turn_max ? std::min(state.turn, turn_max) : state.turn;
+    return outcome;
+}
+
+std::string percent(double fraction) {
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(1) << fraction * 100 << '%';
+    return text.str();
+}
+
+// Sample `unit` of a configuration: battle `unit` of its random stream family, and with antithetic
+// runs that battle's mirror image too. Returns how many battles were fought.
+size_t fightSample(const SweepConfig& config, const std::vector<UnitType>& types, const SweepOptions& options,
+                   uint64_t key, uint64_t unit, StrikeBuffers& buffers, BattleOutcome (&outcomes)[2]) {
+    size_t battles = options.antithetic ? 2 : 1;
+    for (size_t b = 0; b < battles; ++b) {
+        BattleState state = config.opening(types, 0);
+        state.rng.antithetic = b == 1;
+        outcomes[b] = fightQuietly(state, options.turn_max, buffers, BattleRng::keyed(key, unit).next());
+    }
+    return battles;
+}
+
+void runSweep(const std::vector<SweepConfig>& configs, const std::vector<UnitType>& types, const SweepOptions& options, uint64_t seed) {
+    double z = zForConfidence(options.confidence);
+    StrikeBuffers buffers;
+    uint64_t new_battles = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::optional<OutcomeCache> cache;
+    if (!options.cache_path.empty()) cache.emplace(options.cache_path);
+    // With common random numbers the first configuration is the baseline. The samples it fights are
+    // kept so the others can be paired with them, and any others they need are fought on demand.
+    std::unordered_map<uint64_t, SweepSample> baseline;
+    uint64_t baseline_key = 0;
+    std::vector<std::pair<uint64_t, SweepDifference>> differences;
+    std::vector<SweepStats> results;
+    BattleOutcome outcomes[2];
+
+    std::cout << "Sweeping " << configs.size() << " configuration(s) to ±" << percent(options.precision) << " at "
+              << percent(options.confidence) << " confidence, " << options.min_battles << " to " << options.max_battles
+              << " battles each" << (options.antithetic ? ", in antithetic pairs" : "")
+              << (options.common_random_numbers ? ", on common random numbers" : "") << ".\n\n";
+    std::cout << std::left << std::setw(20) << "configuration" << std::right << std::setw(10) << "battles" << std::setw(8) << "new"
+              << std::setw(30) << "Marines win" << std::setw(18) << "Marines left" << std::setw(18) << "Bugs left"
+              << std::setw(10) << "turns" << "\n";
+    for (size_t c = 0; c < configs.size(); ++c) {
+        const SweepConfig& config = configs[c];
+        bool compared = options.common_random_numbers && c > 0;
+
+        // Everything the outcome depends on goes into the cache key
+        OutcomeKey battle_key;
+        battle_key.add(kSweepEngineVersion);
+        addBattle(battle_key, config.opening(types, 0));
+        uint64_t stream_key = options.common_random_numbers ? seed : BattleRng::keyed(seed, battle_key.value()).next();
+        uint64_t key = OutcomeKey().add(battle_key.value()).add(stream_key).add(options.turn_max)
+                           .add(uint32_t(options.antithetic)).value();
+        if (options.common_random_numbers && c == 0) baseline_key = key;
+
+        CachedSweep entry;
+        if (cache) {
+            entry = cache->lookup(key, compared ? baseline_key : 0, stream_key, options.antithetic);
+        } else {
+            entry = CachedSweep{key, compared ? baseline_key : 0, stream_key, 0, {}, {}};
+            entry.stats.paired = options.antithetic;
+        }
+        SweepStats& stats = entry.stats;
+        SweepDifference& difference = entry.difference;
+        uint64_t cached_battles = stats.battles;
+
+        // Compared configurations stop on the precision of their difference from the baseline
+        auto done = [&] {
+            if (stats.battles >= options.max_battles) return true;
+            if (entry.samples < options.min_battles) return false;   // the variance comes from samples, not battles
+            return compared ? difference.precise(options.precision, z) : stats.precise(options.precision, z);
+        };
+        for (; !done(); ++entry.samples) {
+            uint64_t unit = entry.samples;
+            size_t fought = fightSample(config, types, options, stream_key, unit, buffers, outcomes);
+            SweepSample sample = stats.add(outcomes, fought);
+            if (options.common_random_numbers && c == 0) baseline[unit] = sample;
+            if (compared) {
+                auto found = baseline.find(unit);
+                if (found == baseline.end()) {
+                    new_battles += fightSample(configs[0], types, options, stream_key, unit, buffers, outcomes);
+                    found = baseline.emplace(unit, SweepSample::mean(outcomes, options.antithetic ? 2 : 1)).first;
+                }
+                difference.add(sample, found->second);
+            }
+        }
+        new_battles += stats.battles - cached_battles;
+        if (cache) cache->store(entry);
+        if (compared) differences.push_back({stats.battles, difference});
+        results.push_back(stats);
+
+        Interval win_rate = stats.marineWinRate(z);
+        std::cout << std::left << std::setw(20) << config.label << std::right << std::setw(10) << stats.battles
+                  << std::setw(8) << stats.battles - cached_battles
+                  << std::setw(30) << (percent(double(stats.marineWins) / double(stats.battles)) + " [" + percent(win_rate.low)
+                                       + ", " + percent(win_rate.high) + "]")
+                  << std::setw(18) << (percent(stats.marinesLeft.mean()) + " ±" + percent(stats.marinesLeftHalfWidth(z)))
+                  << std::setw(18) << (percent(stats.bugsLeft.mean()) + " ±" + percent(stats.bugsLeftHalfWidth(z)))
+                  << std::setw(10) << std::fixed << std::setprecision(1) << stats.turns.mean() << "\n";
+    }
+    if (cache) cache->save();
+
+    if (!differences.empty()) {
+        auto signed_percent = [](double fraction) { return (fraction >= 0 ? "+" : "") + percent(fraction); };
+        std::cout << "\nAgainst " << configs[0].label << ", battle for battle:\n";
+        for (size_t d = 0; d < differences.size(); ++d) {
+            const SweepDifference& difference = differences[d].second;
+            auto shown = [&](const RunningMean& measure) {
+                return signed_percent(measure.mean()) + " ±" + percent(SweepDifference::halfWidth(measure, z));
+            };
+            std::cout << std::left << std::setw(20) << configs[d + 1].label << std::right << std::setw(10) << differences[d].first
+                      << std::setw(38) << shown(difference.marineWin) << std::setw(18) << shown(difference.marinesLeft)
+                      << std::setw(18) << shown(difference.bugsLeft) << "\n";
+        }
+    }
+
+    if (options.distributions) {
+        std::cout << "\nShare of battles by survivors left: wiped out, then up to each tenth of the force\n";
+        for (size_t c = 0; c < configs.size(); ++c) {
+            for (bool marines : {true, false}) {
+                const uint64_t* bins = marines ? results[c].marinesLeftBins : results[c].bugsLeftBins;
+                std::cout << std::left << std::setw(20) << (marines ? configs[c].label : "") << std::setw(9)
+                          << (marines ? "Marines" : "Bugs") << std::right;
+                for (size_t bin = 0; bin < kSurvivorBins; ++bin) {
+                    std::cout << std::setw(7) << percent(double(bins[bin]) / double(results[c].battles));
+                }
+                std::cout << "\n";
+            }
+        }
+    }
+
+    std::cout << "\n" << new_battles << " battles fought in "
+              << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s, against "
+              << options.max_battles * configs.size() << " for a fixed " << options.max_battles << " each.\n";
+}
+
+int main(int argc, char* argv[]) {
+    // --perf reports hardware counters for the attack and stats phases
+    // --checkpoint=FILE saves the battle to FILE every --checkpoint-every=N turns (10 by default)
+    // --restore=FILE resumes a checkpointed battle instead of raising new forces
+    // --seed=N fixes the random seed. With --restore it branches a what-if run off the checkpoint.
+    // --scenario=FILE fights a battle made by scenario_convert instead of asking for force sizes
+    // --quiet skips the blow-by-blow and the pause between turns, and runs the specialised kernels
+    // --units=FILE loads a table of unit types (unit_types.h), eg to retune the Marine and Bug
+    // --simultaneous has both sides attack at once each turn, in parallel on a thread pool
+    // --turns=N ends the battle after N turns instead of asking
+    // --stats=FILE writes the turn-by-turn curve as CSV, in at most --stats-points=N rows (256)
+    // --wave=TURN:marines|bugs:N[:TYPE] brings N reinforcements in at the start of TURN (any number of times)
+    // --sweep=M:B,M:B,FILE.scn estimates each matchup's odds from as many quiet battles as it takes to
+    //   get them to within --precision=0.01 at --confidence=0.95, between --min-battles=32 and
+    //   --max-battles=100000, each battle ending after --turns=N if given
+    // --crn fights battle i of every configuration on the same random numbers and reports each one's
+    //   difference from the first; --antithetic fights every battle alongside its mirror image
+    // --cache=FILE keeps sweep results on disk and only fights the battles they're missing;
+    //   --distributions prints the survivor histograms. Sweeps use --seed=1 unless told otherwise.
+    // --events=FILE records every attack of the battle in an event log (event_log.h)
+    CheckpointOptions checkpoint;
+    BattleOptions options;
+    bool simultaneous = false;
+    bool turns_given = false;
+    std::string restore_path;
+    std::string scenario_path;
+    std::string units_path;
+    std::string stats_path;
+    std::string events_path;
+    std::vector<std::string> waves;
+    std::string sweep;
+    SweepOptions sweep_options;
+    bool seeded = false;
+    uint64_t seed = uint64_t(time(0));
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--perf") PerfPhases::instance().enable();
+        if (arg.rfind("--checkpoint=", 0) == 0) checkpoint.path = arg.substr(13);
+        if (arg.rfind("--checkpoint-every=", 0) == 0) checkpoint.every = std::max(1, std::stoi(arg.substr(19)));
+        if (arg.rfind("--restore=", 0) == 0) restore_path = arg.substr(10);
+        if (arg.rfind("--scenario=", 0) == 0) scenario_path = arg.substr(11);
+        if (arg == "--quiet") narrate = false;
+        if (arg.rfind("--units=", 0) == 0) units_path = arg.substr(8);
+        if (arg == "--simultaneous") simultaneous = true;
+        if (arg.rfind("--stats=", 0) == 0) stats_path = arg.substr(8);
+        if (arg.rfind("--events=", 0) == 0) events_path = arg.substr(9);
+        if (arg.rfind("--wave=", 0) == 0) waves.push_back(arg.substr(7));
+        if (arg.rfind("--sweep=", 0) == 0) sweep = arg.substr(8);
+        if (arg.rfind("--precision=", 0) == 0) sweep_options.precision = std::stod(arg.substr(12));
+        if (arg.rfind("--confidence=", 0) == 0) sweep_options.confidence = std::stod(arg.substr(13));
+        if (arg.rfind("--min-battles=", 0) == 0) sweep_options.min_battles = std::stoull(arg.substr(14));
+        if (arg == "--crn") sweep_options.common_random_numbers = true;
+        if (arg == "--antithetic") sweep_options.antithetic = true;
+        if (arg.rfind("--cache=", 0) == 0) sweep_options.cache_path = arg.substr(8);
+        if (arg == "--distributions") sweep_options.distributions = true;
+        if (arg.rfind("--max-battles=", 0) == 0) sweep_options.max_battles = std::max(1ull, std::stoull(arg.substr(14)));
+        if (arg.rfind("--stats-points=", 0) == 0) options.stats_points = size_t(std::max(2, std::stoi(arg.substr(15))));
+        if (arg.rfind("--turns=", 0) == 0) {
+            options.turn_max = uint32_t(std::max(0, std::stoi(arg.substr(8))));
+            turns_given = true;
+        }
+        if (arg.rfind("--seed=", 0) == 0) {
+            seed = std::stoull(arg.substr(7));
+            seeded = true;
+        }
+    }
+
     int marine_num = 0;
     int bug_num = 0;
     int turn_max = 0;
     char first_turn;
+    BattleState state;
+    UnitRegistry registry;
 
-    //seed the random number generator with the current time
-    srand(time(0));
+    if (!units_path.empty()) {
+        std::ifstream units(units_path);
+        try {
+            if (!units) throw std::runtime_error("can't open " + units_path);
+            registry.load(units, units_path);
+        } catch (const std::exception& e) {
+            std::cerr << "Can't load the unit types: " << e.what() << "\n";
+            return 1;
+        }
+    }
 
-    // Create vectors to hold different soldier types
-    std::vector<std::unique_ptr<Marine>> marine_force;
-    std::vector<std::unique_ptr<Bug>> bug_force;
+    if (!sweep.empty()) {
+        std::vector<SweepConfig> configs;
+        std::istringstream list(sweep);
+        for (std::string entry; std::getline(list, entry, ',');) {
+            SweepConfig config;
+            config.label = entry;
+            size_t colon = entry.find(':');
+            try {
+                if (colon == std::string::npos) {
+                    config.scenario_path = entry;
+                } else {
+                    config.marines = std::stoull(entry.substr(0, colon));
+                    config.bugs = std::stoull(entry.substr(colon + 1));
+                }
+            } catch (const std::exception&) {
+                config.marines = 0;
+            }
+            if (config.scenario_path.empty() && (config.marines == 0 || config.bugs == 0)) {
+                std::cerr << "Can't make sense of " << entry << " in --sweep, it's MARINES:BUGS or a scenario file\n";
+                return 1;
+            }
+            configs.push_back(config);
+        }
+        if (!(sweep_options.precision > 0) || !(sweep_options.confidence > 0 && sweep_options.confidence < 1)) {
+            std::cerr << "--precision must be above 0 and --confidence between 0 and 1\n";
+            return 1;
+        }
+        sweep_options.turn_max = options.turn_max;
+        narrate = false;
+        // A sweep is an estimate, so the same question gets the same answer (and the cache can hit)
+        if (!seeded) seed = 1;
+        try {
+            runSweep(configs, registry.all(), sweep_options, seed);
+        } catch (const std::exception& e) {
+            std::cerr << "Sweep aborted: " << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
 
     std::cout << "In the grimdark winter of New England, man dreams of endless war with non-man...\n";
     std::cout << "This is a battle simulation of Marines vs Bugs, oorah!\n";
-    
-    while (marine_num == 0) {
-        std::cout << "How many Marines should fight today?\n";
-        std::cin >> marine_num;
-        if (marine_num < 1) {
-            std::cout << "Troop count must be greater than 0.\n";
+
+    if (!restore_path.empty()) {
+        auto start = std::chrono::steady_clock::now();
+        try {
+            state = loadSnapshot(restore_path);
+        } catch (const std::exception& e) {
+            std::cerr << "Can't restore the battle: " << e.what() << "\n";
+            return 1;
+        }
+        if (seeded) state.rng.state = seed;
+        std::cout << "Restored turn " << state.turn << " from " << restore_path << " in "
+                  << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << "ms.\n";
+    } else if (!scenario_path.empty()) {
+        auto start = std::chrono::steady_clock::now();
+        try {
+            state = loadScenario(scenario_path, seed);
+        } catch (const std::exception& e) {
+            std::cerr << "Can't load the scenario: " << e.what() << "\n";
+            return 1;
         }
-    }    
+        if (seeded) state.rng.state = seed;
+        std::cout << "Loaded " << scenario_path << " (" << state.marines.size() << " Marines, " << state.bugs.size()
+                  << " Bugs) in " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << "ms.\n";
+    } else {
+        while (marine_num == 0) {
+            std::cout << "How many Marines should fight today?\n";
+            std::cin >> marine_num;
+            if (marine_num < 1) {
+                std::cout << "Troop count must be greater than 0.\n";
+            }
+        }    
 
-    while (bug_num == 0) {
-        std::cout << "How many Bugs should fight today?\n";
-        std::cin >> bug_num;
-        if (bug_num < 1) {
-            std::cout << "Troop count must be greater than 0.\n";
+        while (bug_num == 0) {
+            std::cout << "How many Bugs should fight today?\n";
+            std::cin >> bug_num;
+            if (bug_num < 1) {
+                std::cout << "Troop count must be greater than 0.\n";
+            }
         }
-    }
 
-    for (int i = 0; i < marine_num; i++) {
-            marine_force.emplace_back(std::make_unique<Marine>());
-    }
+        // Fresh soldiers are zeroed records, so raising a force is one mapping whatever its size.
+        // The registry keeps the Marine and Bug first, where the default groups expect them.
+        state = BattleState(marine_num, bug_num, seed);
+        state.types = registry.all();
+
+        std::cout << "Which force should go first? Select Marines with m or Bugs with b.\n";
+        std::cin >> first_turn;
+        
+        if (first_turn != 'm' && first_turn != 'b') {
+            std::cout << "Invalid choice, defaulting to Marines going first.\n";
+            first_turn = 'm';  // default to Marines if invalid input
+        }
 
-    for (int i = 0; i < bug_num; i++) {
-            bug_force.emplace_back(std::make_unique<Bug>());
+        state.marineTurn = (first_turn == 'm');
     }
 
-    std::cout << "Which force should go first? Select Marines with m or Bugs with b.\n";
-    std::cin >> first_turn;
-    
-    if (first_turn != 'm' && first_turn != 'b') {
-        std::cout << "Invalid choice, defaulting to Marines going first.\n";
-        first_turn = 'm';  // default to Marines if invalid input
+    // Waves from the command line join any the scenario or checkpoint brought
+    for (const std::string& text : waves) {
+        std::istringstream fields(text);
+        std::string turn, side, count, type_name;
+        std::getline(fields, turn, ':');
+        std::getline(fields, side, ':');
+        std::getline(fields, count, ':');
+        std::getline(fields, type_name);
+        if (type_name.empty()) type_name = side == "bugs" ? "Bug" : "Marine";
+        auto type = std::find_if(state.types.begin(), state.types.end(), [&](const UnitType& t) { return type_name == t.name; });
+        Reinforcement wave{};
+        try {
+            wave.turn = uint32_t(std::max(1, std::stoi(turn)));
+            wave.count = std::stoull(count);
+        } catch (const std::exception&) {
+            wave.count = 0;
+        }
+        if ((side != "marines" && side != "bugs") || wave.count == 0 || type == state.types.end()) {
+            std::cerr << "Can't make sense of --wave=" << text << ", it's TURN:marines|bugs:COUNT[:TYPE]\n";
+            return 1;
+        }
+        wave.bugs = side == "bugs";
+        wave.type = uint32_t(type - state.types.begin());
+        state.reinforcements.push_back(wave);
     }
+    std::stable_sort(state.reinforcements.begin(), state.reinforcements.end(),
+                     [](const Reinforcement& a, const Reinforcement& b) { return a.turn < b.turn; });
 
-    marine_turn = (first_turn == 'm');
+    if (!turns_given) {
+        std::cout << "How many turns should this battle go? 0 fights to the end.\n";
+        std::cin >> turn_max;
+        options.turn_max = uint32_t(std::max(0, turn_max));
+    }
 
-    std::cout << "How many turns should this battle go?\n";
-    std::cin >> turn_max;
+    // Simultaneous turns run on all but one core, or one worker on a single core
+    std::optional<ThreadPool> pool;
+    if (simultaneous) {
+        unsigned cores = std::max(2u, std::thread::hardware_concurrency());
+        pool.emplace(cores - 1, NumaTopology::detect());
+        options.pool = &*pool;
+    }
 
     // Fight it out
-    auto [total_marine_hits, total_bug_hits] = gameLoop(marine_force, bug_force);
-    postProcessing(total_marine_hits, total_bug_hits);
+    TurnSeries series(options.stats_points);
+    std::optional<EventLogWriter> events;
+    try {
+        if (!events_path.empty()) {
+            events.emplace(events_path);
+            options.events = &*events;
+        }
+        BattleTotals totals = gameLoop(state, checkpoint, options, series);
+        postProcessing(totals, series);
+        if (events) {
+            events->close();
+            std::cout << events->eventsWritten() << " events written to " << events_path << " (" << events->bytesWritten()
+                      << " bytes, " << std::fixed << std::setprecision(1)
+                      << double(events->bytesWritten()) / double(std::max<uint64_t>(1, events->eventsWritten()))
+                      << " an event).\n" << std::defaultfloat;
+        }
+        if (!stats_path.empty()) {
+            std::ofstream out(stats_path);
+            series.writeCsv(out);
+            if (!out) throw std::runtime_error("can't write " + stats_path);
+            std::cout << "Turn stats written to " << stats_path << " (" << series.turnsPerPoint() << " turn(s) a row).\n";
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Battle aborted: " << e.what() << "\n";
+        return 1;
+    }
+    metrics::dump(std::cout);
     
     std::cout << "Hope you enjoyed the fight! Exiting...\n";
 
     return 0;
-}
\ No newline at end of file
+}
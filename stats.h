@@ -0,0 +1,93 @@
+// Exact counters for stats that many workers bump at once (hits, kills, ...).
+// Every thread counts into its own shard, a row of counters starting on its own cache line that no
+// other thread writes. Bumping a counter is a plain load and store on memory no other core touches,
+// so counting adds no lock and no contended cache line to the hot path. Reads merge the shards.
+// Every counter is repeated in every shard, so memory grows as workers x counters: 64 workers with a
+// counter per soldier for a million soldiers would need gigabytes. Shard a handful of totals here;
+// a count belonging to one item (a soldier's hits) belongs in that item, written by its one owner.
+
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+#include "threadpool.h"
+
+// A small fixed number of counters, sharded per pool worker. A shard is capped at kMaxLinesPerShard
+// cache lines (4 KiB) so a misuse with one counter per item fails up front instead of eating memory.
+template<typename T = uint64_t>
+class ShardedCounters {
+public:
+    static constexpr size_t kMaxLinesPerShard = 64;
+
+    // One shard per pool worker plus one for threads outside the pool. Those all share the extra
+    // shard, so only one outside thread should count at a time.
+    ShardedCounters(const ThreadPool& pool, size_t counters)
+        : counters(counters), linesPerShard(checkedLines(counters)), shards(pool.size() + 1),
+          lines(std::make_unique<Line[]>(linesPerShard * shards)) {}
+
+    ShardedCounters(const ShardedCounters&) = delete;
+    ShardedCounters& operator=(const ShardedCounters&) = delete;
+
+    void add(size_t counter, T n = 1) {
+        std::atomic<T>& cell = at(myShard(), counter);
+        // Only this thread writes its shard, so a relaxed load and store will do, no locked add.
+        // The cells are still atomic so reading totals mid-battle isn't a data race.
+        cell.store(cell.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // Merge on read
+    T total(size_t counter) const {
+        T sum = 0;
+        for (size_t shard = 0; shard < shards; ++shard) sum += at(shard, counter).load(std::memory_order_relaxed);
+        return sum;
+    }
+
+    // Every counter's total, walking each shard front to back
+    std::vector<T> totals() const {
+        std::vector<T> sums(counters, 0);
+        for (size_t shard = 0; shard < shards; ++shard) {
+            for (size_t counter = 0; counter < counters; ++counter) {
+                sums[counter] += at(shard, counter).load(std::memory_order_relaxed);
+            }
+        }
+        return sums;
+    }
+
+    size_t size() const { return counters; }
+
+private:
+    static constexpr size_t kPerLine = 64 / sizeof(T);
+
+    struct alignas(64) Line {
+        std::atomic<T> cells[kPerLine];
+    };
+
+    static size_t checkedLines(size_t counters) {
+        size_t needed = (counters + kPerLine - 1) / kPerLine;
+        if (needed > kMaxLinesPerShard) {
+            throw std::length_error(std::to_string(counters) + " sharded counters is more than a shard holds ("
+                                    + std::to_string(kMaxLinesPerShard * kPerLine) + ")");
+        }
+        return needed;
+    }
+
+    size_t myShard() const {
+        int worker = ThreadPool::currentWorker();
+        return worker >= 0 ? size_t(worker) : shards - 1;
+    }
+
+    std::atomic<T>& at(size_t shard, size_t counter) const {
+        return lines[shard * linesPerShard + counter / kPerLine].cells[counter % kPerLine];
+    }
+
+    size_t counters;
+    size_t linesPerShard;
+    size_t shards;
+    std::unique_ptr<Line[]> lines;
+};
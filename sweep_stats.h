@@ -0,0 +1,195 @@
+// Online estimates for Monte-Carlo sweeps: many quiet battles of one configuration, summed as they
+// finish, with confidence intervals that say when there have been enough of them.
+//     SweepStats stats;
+//     double z = zForConfidence(0.95);
+//     while (!stats.precise(0.01, z)) stats.add(fight());
+// The win rate gets a Wilson score interval, which stays honest near 0 and 1 where lopsided
+// matchups live, and the means (survivors, turns) a normal interval from their running variance.
+// Survivors are fractions of the starting force, so one precision fits every measure. Samples that
+// all agree have zero variance, so the survivor and difference intervals are smoothed towards their
+// bounds (RunningMean::boundedHalfWidth) and the paired win rate is never narrower than Wilson's.
+//
+// Two ways to need fewer battles (see runSweep() in soldier_w_turns.cpp):
+// - Antithetic pairs: each sample is the mean of a battle and its mirror image (BattleRng::antithetic),
+//   whose luck runs the other way, so the pair varies less than two independent battles. Intervals
+//   then come from the variance of the pair means, including the win rate's.
+// - Common random numbers: every configuration fights battle i with the same random stream, so the
+//   difference between two configurations is mostly the difference in their stats, not their luck.
+//   SweepDifference keeps the interval on those paired differences.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+// How one battle ended
+struct BattleOutcome {
+    enum Winner : uint8_t { kMarines, kBugs, kNobody };    // kNobody: called off, or mutual wipe-out
+    Winner winner = kNobody;
+    double marinesLeft = 0;     // standing at the end, as a fraction of all the Marines that fought
+    double bugsLeft = 0;
+    uint32_t turns = 0;
+};
+
+// Welford's running mean and variance
+class RunningMean {
+public:
+    void add(double x) {
+        ++n;
+        double delta = x - mean_;
+        mean_ += delta / double(n);
+        m2 += delta * (x - mean_);
+    }
+
+    uint64_t count() const { return n; }
+    double mean() const { return mean_; }
+    double variance() const { return n > 1 ? m2 / double(n - 1) : 0; }
+    // Half the width of the interval on the mean
+    double halfWidth(double z) const { return n > 1 ? z * std::sqrt(variance() / double(n)) : INFINITY; }
+
+    // The same for values known to lie in [low, high], but never narrower than the spread of two
+    // pseudo-samples, one at each bound (add-one smoothing). A run of identical samples then narrows
+    // the interval like 1/n instead of closing it at once.
+    double boundedHalfWidth(double z, double low, double high) const {
+        if (n < 2) return INFINITY;
+        double floor = ((low - mean_) * (low - mean_) + (high - mean_) * (high - mean_)) / double(n + 1);
+        return std::fmax(halfWidth(z), z * std::sqrt(floor / double(n + 2)));
+    }
+
+private:
+    uint64_t n = 0;
+    double mean_ = 0;
+    double m2 = 0;
+};
+
+struct Interval {
+    double low;
+    double high;
+    double halfWidth() const { return (high - low) / 2; }
+};
+
+// Wilson score interval on a proportion of successes in n trials
+inline Interval wilsonInterval(uint64_t successes, uint64_t n, double z) {
+    if (n == 0) return {0, 1};
+    double p = double(successes) / double(n);
+    double z2n = z * z / double(n);
+    double centre = (p + z2n / 2) / (1 + z2n);
+    double spread = z * std::sqrt(p * (1 - p) / double(n) + z2n / (4 * double(n))) / (1 + z2n);
+    return {std::fmax(0, centre - spread), std::fmin(1, centre + spread)};
+}
+
+// z such that a normal variable is within ±z of its mean with the given probability, eg 1.96 for 0.95.
+// Bisects erfc, which is monotonic; 60 halvings is below double precision.
+inline double zForConfidence(double confidence) {
+    double low = 0, high = 10;
+    for (int i = 0; i < 60; ++i) {
+        double z = (low + high) / 2;
+        if (std::erfc(z / std::sqrt(2.0)) > 1 - confidence) low = z; else high = z;
+    }
+    return (low + high) / 2;
+}
+
+// One battle, or the mean of an antithetic pair
+struct SweepSample {
+    double marineWin = 0;       // share of the battles the Marines won
+    double marinesLeft = 0;
+    double bugsLeft = 0;
+    double turns = 0;
+
+    static SweepSample mean(const BattleOutcome* outcomes, size_t count) {
+        SweepSample sample;
+        for (size_t i = 0; i < count; ++i) {
+            sample.marineWin += outcomes[i].winner == BattleOutcome::kMarines;
+            sample.marinesLeft += outcomes[i].marinesLeft;
+            sample.bugsLeft += outcomes[i].bugsLeft;
+            sample.turns += outcomes[i].turns;
+        }
+        sample.marineWin /= double(count);
+        sample.marinesLeft /= double(count);
+        sample.bugsLeft /= double(count);
+        sample.turns /= double(count);
+        return sample;
+    }
+};
+
+// Survivors as a histogram: bin 0 is a force wiped out, bin k (1..10) up to k tenths of it left
+constexpr size_t kSurvivorBins = 11;
+
+inline size_t survivorBin(double fraction) {
+    if (fraction <= 0) return 0;
+    return std::min(kSurvivorBins - 1, size_t(std::ceil(fraction * 10)));
+}
+
+struct SweepStats {
+    uint64_t battles = 0;
+    uint64_t marineWins = 0;
+    uint64_t bugWins = 0;
+    bool paired = false;        // samples are antithetic pairs
+    RunningMean marineWin;
+    RunningMean marinesLeft;
+    RunningMean bugsLeft;
+    RunningMean turns;
+    uint64_t marinesLeftBins[kSurvivorBins] = {};
+    uint64_t bugsLeftBins[kSurvivorBins] = {};
+
+    // The battles of one sample: one, or an antithetic pair
+    SweepSample add(const BattleOutcome* outcomes, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            ++battles;
+            marineWins += outcomes[i].winner == BattleOutcome::kMarines;
+            bugWins += outcomes[i].winner == BattleOutcome::kBugs;
+            marinesLeftBins[survivorBin(outcomes[i].marinesLeft)]++;
+            bugsLeftBins[survivorBin(outcomes[i].bugsLeft)]++;
+        }
+        SweepSample sample = SweepSample::mean(outcomes, count);
+        marineWin.add(sample.marineWin);
+        marinesLeft.add(sample.marinesLeft);
+        bugsLeft.add(sample.bugsLeft);
+        turns.add(sample.turns);
+        return sample;
+    }
+
+    void add(const BattleOutcome& outcome) { add(&outcome, 1); }
+
+    // Wilson on single battles. Pair means aren't successes and failures, so they get a normal
+    // interval, widened to cover Wilson's on the raw battles: pairs that all agree have no variance.
+    Interval marineWinRate(double z) const {
+        Interval wilson = wilsonInterval(marineWins, battles, z);
+        if (!paired) return wilson;
+        double spread = marineWin.halfWidth(z);
+        return {std::fmax(0, std::fmin(wilson.low, marineWin.mean() - spread)),
+                std::fmin(1, std::fmax(wilson.high, marineWin.mean() + spread))};
+    }
+
+    double marinesLeftHalfWidth(double z) const { return marinesLeft.boundedHalfWidth(z, 0, 1); }
+    double bugsLeftHalfWidth(double z) const { return bugsLeft.boundedHalfWidth(z, 0, 1); }
+
+    // Whether the Marines' win rate and both sides' mean survivors are known to within ±precision
+    bool precise(double precision, double z) const {
+        return marineWinRate(z).halfWidth() <= precision && marinesLeftHalfWidth(z) <= precision
+            && bugsLeftHalfWidth(z) <= precision;
+    }
+};
+
+// One configuration against a baseline, sample by sample, when both fought on the same random numbers
+struct SweepDifference {
+    RunningMean marineWin;
+    RunningMean marinesLeft;
+    RunningMean bugsLeft;
+
+    void add(const SweepSample& sample, const SweepSample& baseline) {
+        marineWin.add(sample.marineWin - baseline.marineWin);
+        marinesLeft.add(sample.marinesLeft - baseline.marinesLeft);
+        bugsLeft.add(sample.bugsLeft - baseline.bugsLeft);
+    }
+
+    // Every difference is of two shares, so it lies in [-1, 1]
+    static double halfWidth(const RunningMean& differences, double z) { return differences.boundedHalfWidth(z, -1, 1); }
+
+    bool precise(double precision, double z) const {
+        return halfWidth(marineWin, z) <= precision && halfWidth(marinesLeft, z) <= precision
+            && halfWidth(bugsLeft, z) <= precision;
+    }
+};
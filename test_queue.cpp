@@ -0,0 +1,157 @@
+// Checks that ThreadSafeQueue's blocking push() and pop() (threadpool.h) never sleep through a
+// wakeup. A slot is claimed (its position counter moved) before it is filled or emptied, so a
+// thread stalled between the two must still wake a sleeper once it finishes. The item type here
+// stalls inside its move assignment while its gate is shut, which is exactly that window.
+// The event log's writer (event_log.h) hands batches to its thread through the queue and ends
+// with an empty one, so closing the log is checked too.
+// Each case fails after a timeout rather than hanging, and the program exits 1 if any case failed.
+// Build with: g++ -std=c++20 -O2 -pthread test_queue.cpp -o test_queue
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event_log.h"
+#include "threadpool.h"
+
+// Moving out of an item whose gate is shut waits for the gate to open
+struct Gated {
+    int value = -1;
+    std::atomic<bool>* shut = nullptr;
+
+    Gated() = default;
+    Gated(int value, std::atomic<bool>* shut) : value(value), shut(shut) {}
+    Gated(Gated&& other) noexcept : value(other.value), shut(other.shut) {}
+
+    Gated& operator=(Gated&& other) noexcept {
+        while (other.shut && other.shut->load()) std::this_thread::yield();
+        value = other.value;
+        shut = other.shut;
+        return *this;
+    }
+};
+
+// Waits up to a few seconds for done. A thread stuck in the queue can't be joined, so a failed
+// case leaves the process to exit with it still blocked.
+bool finishes(const std::atomic<int>& done, int target) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(3);
+    while (done.load() < target) {
+        if (std::chrono::steady_clock::now() > deadline) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+// Long enough for a blocked thread to get past spinning and yielding and go to sleep
+void letItSleep() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+}
+
+// Producer A claims slot 0 and stalls filling it; producer B fills slot 1. The consumer, asleep in
+// pop() on slot 0, must wake when A finally publishes.
+bool popWakesForALateProducer() {
+    static ThreadSafeQueue<Gated> queue(4);
+    static std::atomic<bool> shut{true};
+    static std::atomic<int> popped{0};
+    std::thread a([] { queue.push(Gated(0, &shut)); });
+    while (queue.empty()) std::this_thread::yield();     // A has claimed its slot
+    std::thread consumer([] {
+        for (int i = 0; i < 2; ++i) {
+            queue.pop();
+            popped++;
+        }
+    });
+    letItSleep();
+    queue.push(Gated(1, nullptr));
+    letItSleep();
+    shut = false;
+    if (!finishes(popped, 2)) {
+        a.detach();
+        consumer.detach();
+        return false;
+    }
+    a.join();
+    consumer.join();
+    return true;
+}
+
+// The mirror image: on a full queue, consumer A claims slot 0 and stalls emptying it; consumer B
+// empties slot 1. The producer, asleep in push() waiting for room, must wake when A finally releases.
+bool pushWakesForALateConsumer() {
+    static ThreadSafeQueue<Gated> queue(2);
+    static std::atomic<bool> shut{false};
+    static std::atomic<int> pushed{0};
+    queue.push(Gated(0, &shut));
+    queue.push(Gated(1, nullptr));
+    shut = true;
+    std::thread a([] { queue.pop(); });
+    letItSleep();                                       // A has claimed slot 0 and is stalled emptying it
+    std::thread producer([] {
+        queue.push(Gated(2, nullptr));
+        pushed++;
+    });
+    letItSleep();
+    queue.pop();                                        // B
+    letItSleep();
+    shut = false;
+    if (!finishes(pushed, 1)) {
+        a.detach();
+        producer.detach();
+        return false;
+    }
+    a.join();
+    producer.join();
+    return true;
+}
+
+// Many short logs of many small batches, each closed as soon as its last batch is in: close() has
+// to return, and every event has to be in the log
+bool eventLogCloses() {
+    static std::atomic<int> closed{0};
+    static std::atomic<bool> complete{true};
+    std::thread logs([] {
+        std::string path = "test_queue." + std::to_string(getpid()) + ".events";
+        for (int round = 0; round < 200; ++round) {
+            uint64_t written = 0;
+            {
+                EventLogWriter log(path, 2);
+                for (uint32_t tick = 0; tick < 50; ++tick) {
+                    std::vector<BattleEvent> events(tick % 5 + 1, BattleEvent{tick, 1, 2, 50, kHit});
+                    written += events.size();
+                    log.submit(events);
+                }
+                log.close();
+            }
+            complete = complete && EventLogReader(path).eventCount() == written;
+            closed++;
+        }
+        std::remove(path.c_str());
+    });
+    if (!finishes(closed, 200)) {
+        logs.detach();
+        return false;
+    }
+    logs.join();
+    return complete;
+}
+
+int main() {
+    struct Case {
+        const char* name;
+        bool (*test)();
+    };
+    bool ok = true;
+    for (const Case& c : {Case{"pop() wakes for a producer that publishes late", popWakesForALateProducer},
+                          Case{"push() wakes for a consumer that releases late", pushWakesForALateConsumer},
+                          Case{"an event log closes with every event written", eventLogCloses}}) {
+        bool passed = c.test();
+        std::cout << (passed ? "ok    " : "FAIL  ") << c.name << "\n";
+        ok &= passed;
+    }
+    std::cout.flush();
+    std::_Exit(ok ? 0 : 1);
+}
@@ -0,0 +1,999 @@
+// Thread pool shared by the pool-based battle (soldier_w_threadpool.cpp) and its benchmarks (bench_pool.cpp).
+// Workers are pinned per NUMA node with one bounded lock-free queue per node, tasks are move-only
+// Tasks that keep small captures inline, so submitting a task doesn't allocate or take a lock.
+// submit() hands back a Future for the task's result, post() is fire-and-forget, and a TaskGraph
+// runs dependent steps (eg the phases of a battle tick) with each step starting as soon as it can.
+// Idle workers spin, then yield, then park on a futex (see IdlePolicy), and posts wake parked
+// workers in batches, so a short tick hands work over without a syscall per task.
+// With -DBUGHUNT_METRICS=1 the queues record their depth, workers how long tasks sat queued (metrics.h),
+// and the pool mutex its contention and hold times (profiled_mutex.h).
+// With -DBUGHUNT_TRACE=1 tasks, graph steps, parking and lock waits show up on a timeline (trace.h).
+
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <memory>
+#include <deque>
+#include <optional>
+#include <exception>
+#include <new>
+#include <type_traits>
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <pthread.h>    // pthread_setaffinity_np() for pinning workers
+#include <sched.h>      // cpu_set_t, sched_getaffinity()
+#include <unistd.h>     // syscall()
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>   // MPOL_PREFERRED for mbind()
+
+#include "metrics.h"
+#include "trace.h"
+#include "profiled_mutex.h"
+
+// Bounded lock-free multi-producer/multi-consumer queue (Vyukov's ring of sequence-numbered slots).
+// Each slot's sequence number says whose turn it is: a producer may fill slot pos when its
+// sequence equals pos, a consumer may empty it when it equals pos + 1. Producers and consumers
+// only ever CAS their own position counter, so they never wait on a lock or on each other.
+// Items are moved in and out, never copied, so move-only types like Task work.
+// push()/pop() block, push() applying backpressure when the queue is full: spin, then yield,
+// then sleep until a slot frees up (or an item arrives). They sleep on `released` (or `published`),
+// counters bumped only once a slot has been emptied (or filled). A position counter won't do, as
+// it moves when a slot is claimed, before it is ready. A sleeper could see the counter move before
+// it sleeps and then miss the wakeup sent once the slot is ready.
+template<typename T>
+class ThreadSafeQueue {
+public:
+    // Capacity is rounded up to a power of two
+    explicit ThreadSafeQueue(size_t capacity = 1024) {
+        size_t size = 2;
+        while (size < capacity) size *= 2;
+        mask = size - 1;
+        cells = std::make_unique<Cell[]>(size);
+        for (size_t i = 0; i < size; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    //Push a task to the queue, waiting for room if it is full
+    void push(T item) {
+        for (int attempt = 0;; ++attempt) {
+            // Read before trying, so a slot freed after the try changes it and the sleep falls through
+            uint32_t seen = released.load(std::memory_order_acquire);
+            if (tryPush(std::move(item))) return;
+            backoff(attempt, released, seen);
+        }
+    }
+
+    // Threads pop a task off the queue, waiting for one if it is empty
+    T pop() {
+        T item;
+        for (int attempt = 0;; ++attempt) {
+            uint32_t seen = published.load(std::memory_order_acquire);
+            if (tryPop(item)) return item;
+            backoff(attempt, published, seen);
+        }
+    }
+
+    // Returns false if the queue is full. item is only moved from on success.
+    bool tryPush(T&& item) {
+        Cell* cell;
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells[pos & mask];
+            intptr_t diff = intptr_t(cell->sequence.load(std::memory_order_acquire)) - intptr_t(pos);
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;   // the consumer of the previous lap hasn't emptied this slot yet
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(item);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        published.fetch_add(1, std::memory_order_release);
+        published.notify_one();
+        if constexpr (metrics::kEnabled) recordDepth(pos + 1);
+        return true;
+    }
+
+    // Non-blocking pop, so a worker can check its own node's queue and then steal from others
+    bool tryPop(T& item) {
+        Cell* cell;
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells[pos & mask];
+            intptr_t diff = intptr_t(cell->sequence.load(std::memory_order_acquire)) - intptr_t(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;   // nothing published here yet
+            } else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        item = std::move(cell->data);
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        released.fetch_add(1, std::memory_order_release);
+        released.notify_one();
+        return true;
+    }
+
+    // Push as many of items[0..count) as fit with a single claim on the producer position.
+    // Returns how many were pushed; those are moved from, the rest are untouched.
+    size_t tryPushBulk(T* items, size_t count) {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        size_t n;
+        while (true) {
+            // Free slots stay free until a producer claims them, so a checked run can't be taken from under us
+            n = 0;
+            while (n < count && cells[(pos + n) & mask].sequence.load(std::memory_order_acquire) == pos + n) ++n;
+            if (n == 0) return 0;
+            if (enqueuePos.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)) break;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            Cell& cell = cells[(pos + i) & mask];
+            cell.data = std::move(items[i]);
+            cell.sequence.store(pos + i + 1, std::memory_order_release);
+        }
+        published.fetch_add(uint32_t(n), std::memory_order_release);
+        published.notify_all();
+        if constexpr (metrics::kEnabled) recordDepth(pos + n);
+        return n;
+    }
+
+    // Pop up to count items into out with a single claim on the consumer position. Returns how many.
+    size_t tryPopBulk(T* out, size_t count) {
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        size_t n;
+        while (true) {
+            n = 0;
+            while (n < count && cells[(pos + n) & mask].sequence.load(std::memory_order_acquire) == pos + n + 1) ++n;
+            if (n == 0) return 0;
+            if (dequeuePos.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)) break;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            Cell& cell = cells[(pos + i) & mask];
+            out[i] = std::move(cell.data);
+            cell.sequence.store(pos + i + mask + 1, std::memory_order_release);
+        }
+        released.fetch_add(uint32_t(n), std::memory_order_release);
+        released.notify_all();
+        return n;
+    }
+
+    // Claimed but not yet published items count as present, so this can briefly say non-empty
+    // while tryPop() still fails.
+    bool empty() const {
+        return dequeuePos.load(std::memory_order_acquire) >= enqueuePos.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+private:
+    // One slot per cache line so neighbouring producers/consumers don't false-share
+    struct alignas(64) Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    // Items queued once the push that ended at position end was published (consumers may have moved past it since)
+    void recordDepth(size_t end) {
+        static metrics::Histogram& depth = metrics::histogram("queue.depth");
+        size_t consumed = dequeuePos.load(std::memory_order_relaxed);
+        depth.record(end > consumed ? end - consumed : 0);
+    }
+
+    // Spin, then yield, then sleep until the other side has finished with a slot since seen was read
+    static void backoff(int attempt, std::atomic<uint32_t>& finished, uint32_t seen) {
+        if (attempt < 64) return;
+        if (attempt < 128) {
+            std::this_thread::yield();
+            return;
+        }
+        trace::Span span("queue wait", "queue");
+        finished.wait(seen, std::memory_order_acquire);
+    }
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueuePos{0};
+    alignas(64) std::atomic<size_t> dequeuePos{0};
+    // Slots filled and emptied so far (mod 2^32), for push() and pop() to sleep on
+    alignas(64) std::atomic<uint32_t> published{0};
+    alignas(64) std::atomic<uint32_t> released{0};
+};
+
+// Move-only stand-in for std::function<void()>. Callables up to kInlineSize bytes (a handful
+// of captured pointers and indices, which covers every task we submit) live inside the Task
+// itself, so making, queueing and running one never touches the heap. Bigger callables fall
+// back to a single heap allocation. Being move-only, a Task can also own things like a
+// std::packaged_task that std::function refuses to hold.
+class Task {
+public:
+    static constexpr size_t kInlineSize = 48;
+
+    Task() noexcept = default;
+
+    template<typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F&& fn) {
+        using Fn = std::decay_t<F>;
+        if constexpr (fitsInline<Fn>()) {
+            new (storage) Fn(std::forward<F>(fn));
+            ops = &inlineOps<Fn>;
+        } else {
+            *reinterpret_cast<Fn**>(storage) = new Fn(std::forward<F>(fn));
+            ops = &heapOps<Fn>;
+        }
+    }
+
+    Task(Task&& other) noexcept : ops(other.ops) {
+        stamp = other.stamp;
+        if (ops) {
+            ops->move(other.storage, storage);
+            other.ops = nullptr;
+        }
+    }
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            reset();
+            ops = other.ops;
+            stamp = other.stamp;
+            if (ops) {
+                ops->move(other.storage, storage);
+                other.ops = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() { reset(); }
+
+    explicit operator bool() const noexcept { return ops != nullptr; }
+
+    void operator()() { ops->invoke(storage); }
+
+    // Queue-time bookkeeping for the pool's task wait metric. Free when metrics are compiled out.
+    void markQueued() { stamp.set(metrics::nowNs()); }
+    uint64_t queuedFor() const { return metrics::nowNs() - stamp.get(); }
+
+private:
+    // What a Task needs to know about the callable it holds
+    struct Ops {
+        void (*invoke)(void* storage);
+        void (*move)(void* from, void* to) noexcept;     // move-construct into to, destroy from
+        void (*destroy)(void* storage) noexcept;
+    };
+
+    template<typename Fn>
+    static constexpr bool fitsInline() {
+        return sizeof(Fn) <= kInlineSize && alignof(Fn) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible_v<Fn>;
+    }
+
+    template<typename Fn>
+    static constexpr Ops inlineOps = {
+        [](void* storage) { (*static_cast<Fn*>(storage))(); },
+        [](void* from, void* to) noexcept {
+            new (to) Fn(std::move(*static_cast<Fn*>(from)));
+            static_cast<Fn*>(from)->~Fn();
+        },
+        [](void* storage) noexcept { static_cast<Fn*>(storage)->~Fn(); },
+    };
+
+    // storage holds a pointer to the callable, moving just hands the pointer over
+    template<typename Fn>
+    static constexpr Ops heapOps = {
+        [](void* storage) { (**static_cast<Fn**>(storage))(); },
+        [](void* from, void* to) noexcept { *static_cast<Fn**>(to) = *static_cast<Fn**>(from); },
+        [](void* storage) noexcept { delete *static_cast<Fn**>(storage); },
+    };
+
+    void reset() noexcept {
+        if (ops) {
+            ops->destroy(storage);
+            ops = nullptr;
+        }
+    }
+
+    // Only takes up room when metrics are on
+    struct Stamp {
+        uint64_t queuedAt = 0;
+        void set(uint64_t ns) { queuedAt = ns; }
+        uint64_t get() const { return queuedAt; }
+    };
+    struct NoStamp {
+        void set(uint64_t) {}
+        uint64_t get() const { return 0; }
+    };
+
+    alignas(std::max_align_t) unsigned char storage[kInlineSize];
+    const Ops* ops = nullptr;
+    [[no_unique_address]] std::conditional_t<metrics::kEnabled, Stamp, NoStamp> stamp;
+};
+
+class ThreadPool;
+
+// Result of ThreadPool::submit(). The task and the future share one small block holding the
+// result (or whatever the task threw) and a ready flag, so there is no mutex or condition
+// variable per task. Waiting from inside a pool task runs other queued tasks in the meantime,
+// so a worker never sits blocked on work that may be queued behind it.
+template<typename T>
+class Future {
+public:
+    Future() = default;
+
+    bool valid() const { return state != nullptr; }
+    bool ready() const { return state->ready.load(std::memory_order_acquire); }
+
+    void wait() const;
+
+    // Wait for the result and take it. Rethrows the task's exception. The future is empty afterwards.
+    T get() {
+        wait();
+        std::shared_ptr<State> result = std::move(state);
+        if (result->error) std::rethrow_exception(result->error);
+        if constexpr (!std::is_void_v<T>) return std::move(*result->value);
+    }
+
+private:
+    friend class ThreadPool;
+
+    struct State {
+        std::atomic<bool> ready{false};
+        std::optional<std::conditional_t<std::is_void_v<T>, bool, T>> value;
+        std::exception_ptr error;
+    };
+
+    Future(std::shared_ptr<State> state, ThreadPool* pool) : state(std::move(state)), pool(pool) {}
+
+    std::shared_ptr<State> state;
+    ThreadPool* pool = nullptr;
+};
+
+// Which CPUs belong to which NUMA node. Read from sysfs and limited to the CPUs this process
+// may run on. Machines (or containers) without NUMA info are treated as a single node.
+struct NumaTopology {
+    std::vector<std::vector<int>> nodeCpus;
+    std::vector<int> nodeIds;       // the kernel's number for each node, for mbind() and move_pages()
+
+    static NumaTopology detect() {
+        NumaTopology topo;
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        bool haveMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+        for (int node = 0; ; ++node) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!file) break;
+            std::string list;
+            std::getline(file, list);
+
+            // cpulist looks like "0-3,8-11"
+            std::vector<int> cpus;
+            std::stringstream ss(list);
+            std::string range;
+            while (std::getline(ss, range, ',')) {
+                if (range.empty()) continue;
+                size_t dash = range.find('-');
+                int first = std::stoi(range.substr(0, dash));
+                int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                for (int cpu = first; cpu <= last; ++cpu) {
+                    if (!haveMask || CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+                }
+            }
+            if (!cpus.empty()) {
+                topo.nodeCpus.push_back(cpus);
+                topo.nodeIds.push_back(node);
+            }
+        }
+
+        if (topo.nodeCpus.empty()) {
+            std::vector<int> cpus;
+            int numCpus = std::max(1u, std::thread::hardware_concurrency());
+            for (int cpu = 0; cpu < numCpus; ++cpu) cpus.push_back(cpu);
+            topo.nodeCpus.push_back(cpus);
+            topo.nodeIds.push_back(0);
+        }
+        return topo;
+    }
+
+    size_t numNodes() const { return nodeCpus.size(); }
+
+    // Our index of the kernel's node id, -1 if it isn't one of ours
+    int nodeIndex(int id) const {
+        auto found = std::find(nodeIds.begin(), nodeIds.end(), id);
+        return found == nodeIds.end() ? -1 : int(found - nodeIds.begin());
+    }
+};
+
+// Anonymous memory whose pages the kernel places on one node (our index), whichever thread touches
+// them first. The policy is "preferred", so a full node spills over instead of failing; nodeOfPages()
+// says where the pages actually went. bound is false if the kernel refused the policy (no NUMA
+// support, or not allowed in a container), which leaves placement to first touch.
+struct NodeMemory {
+    void* data = nullptr;
+    size_t bytes = 0;
+    bool bound = false;
+};
+
+inline NodeMemory allocateOnNode(const NumaTopology& topo, int node, size_t bytes) {
+    NodeMemory memory;
+    if (bytes == 0) return memory;
+    void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) throw std::bad_alloc();
+    memory.data = p;
+    memory.bytes = bytes;
+    int id = topo.nodeIds[node];
+    constexpr size_t kMaskBits = 1024;
+    unsigned long mask[kMaskBits / (8 * sizeof(unsigned long))] = {};
+    if (id >= 0 && size_t(id) < kMaskBits) {
+        mask[id / (8 * sizeof(unsigned long))] |= 1ul << (id % (8 * sizeof(unsigned long)));
+        memory.bound = syscall(SYS_mbind, p, bytes, MPOL_PREFERRED, mask, kMaskBits, 0) == 0;
+    }
+    return memory;
+}
+
+inline void freeNodeMemory(NodeMemory& memory) {
+    if (memory.data) munmap(memory.data, memory.bytes);
+    memory = NodeMemory();
+}
+
+// The node (our index) holding most of memory's touched pages, from a sample of up to 64 of them,
+// or -1 if the kernel can't say (no move_pages(), or none of the pages are in memory yet)
+inline int nodeOfPages(const NumaTopology& topo, const NodeMemory& memory) {
+    if (!memory.data) return -1;
+    size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+    size_t pages = (memory.bytes + pageSize - 1) / pageSize;
+    size_t step = std::max<size_t>(1, pages / 64);
+    std::vector<void*> sample;
+    for (size_t page = 0; page < pages; page += step) {
+        sample.push_back(static_cast<char*>(memory.data) + page * pageSize);
+    }
+    // With no target nodes, move_pages() only reports where each page is
+    std::vector<int> status(sample.size(), -1);
+    if (syscall(SYS_move_pages, 0, sample.size(), sample.data(), nullptr, status.data(), 0) != 0) return -1;
+    std::vector<size_t> counts(topo.numNodes(), 0);
+    for (int id : status) {
+        int node = id >= 0 ? topo.nodeIndex(id) : -1;
+        if (node >= 0) counts[node]++;
+    }
+    auto most = std::max_element(counts.begin(), counts.end());
+    return *most > 0 ? int(most - counts.begin()) : -1;
+}
+
+// Thin wrappers over the Linux futex syscall, which is what parked workers sleep on.
+// futexWait() sleeps only if word still holds expected, so a wake between the check and the sleep isn't lost.
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be a plain 32-bit int");
+
+inline void futexWait(std::atomic<uint32_t>& word, uint32_t expected) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+inline void futexWake(std::atomic<uint32_t>& word, int count) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
+
+// Tell the core we're busy-waiting (saves power, and frees the pipeline for a hyperthread sibling)
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// How an idle worker waits for its next task: spin for up to `spin`, then yield the core up to
+// `yields` times, then park on a futex until a post wakes it. Spinning picks up a task within
+// nanoseconds but burns the core; parking costs nothing while idle but a syscall on each side
+// (microseconds) to wake. Short ticks want lowLatency(), a mostly idle pool wants lowCpu().
+// Each worker adapts within the limit: its spin window doubles when spinning found work and halves
+// when it parked anyway. When there are more workers than cores spinning only delays the thread
+// that would post the work, so the pool doesn't spin at all then.
+struct IdlePolicy {
+    std::chrono::nanoseconds spin = std::chrono::microseconds(20);
+    unsigned yields = 8;
+
+    static IdlePolicy lowLatency() { return {std::chrono::microseconds(200), 64}; }
+    static IdlePolicy balanced() { return {}; }
+    static IdlePolicy lowCpu() { return {std::chrono::nanoseconds(0), 0}; }
+};
+
+// Local vs remote touches of soldier data, one counter block per worker.
+// alignas(64) keeps each worker's counters on its own cache line so counting doesn't false-share.
+struct alignas(64) AccessCounter {
+    uint64_t local = 0;
+    uint64_t remote = 0;
+    uint64_t unplaced = 0;      // data whose node couldn't be checked
+};
+
+// This class manages a pool of threads, each of which continuously pulls tasks
+// from the queue and executes them. Tasks are submitted using submit() or post().
+// Worker i is pinned to a core on node (i % numNodes), so workers are spread evenly over the nodes.
+class ThreadPool {
+public:
+    ThreadPool(size_t numThreads, const NumaTopology& topology, IdlePolicy idle = IdlePolicy::balanced())
+        : stopFlag(false), topo(topology), idle(idle) {
+        numThreads = std::max<size_t>(1, numThreads);
+        size_t cpus = 0;
+        for (const std::vector<int>& nodeCpus : topo.nodeCpus) cpus += nodeCpus.size();
+        if (numThreads + 1 > cpus) this->idle.spin = std::chrono::nanoseconds(0);     // workers plus the caller
+
+        for (size_t node = 0; node < topo.numNodes(); ++node) {
+            nodeQueues.push_back(std::make_unique<ThreadSafeQueue<Task>>(kQueueCapacity));
+        }
+        // One extra counter block for threads outside the pool (eg main)
+        accessCounters.resize(numThreads + 1);
+
+        //start worker threads
+        for (size_t i = 0; i < numThreads; ++i) {
+            int node = i % topo.numNodes();
+            const std::vector<int>& cpus = topo.nodeCpus[node];
+            int cpu = cpus[(i / topo.numNodes()) % cpus.size()];
+            workerNodes.push_back(node);
+            workers.push_back(std::thread(&ThreadPool::worker, this, i, node));
+
+            // Pin the worker. If the OS refuses we keep going, the node assignment is still used for scheduling.
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(cpu, &cpuset);
+            if (pthread_setaffinity_np(workers.back().native_handle(), sizeof(cpuset), &cpuset) == 0) {
+                ++pinnedCount;
+            }
+        }
+    }
+
+    ~ThreadPool(){
+        stopFlag = true;
+        parkSeq.fetch_add(1);
+        futexWake(parkSeq, INT_MAX);
+        for (std::thread& worker : workers) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+
+    // Queue fn on the given node and return a Future for its result. fn lives in the future's shared
+    // block and the queued Task only holds a pointer to it, so the one allocation for that block is
+    // the only extra cost over post(), however big fn's captures are.
+    template<typename F, typename R = std::invoke_result_t<std::decay_t<F>&>>
+    Future<R> submit(F&& fn, int node = 0) {
+        using State = typename Future<R>::State;
+        struct Job : State {
+            std::decay_t<F> fn;
+            explicit Job(F&& fn) : fn(std::forward<F>(fn)) {}
+        };
+
+        auto job = std::make_shared<Job>(std::forward<F>(fn));
+        post([job]() {
+            try {
+                if constexpr (std::is_void_v<R>) {
+                    job->fn();
+                    job->value.emplace(true);
+                } else {
+                    job->value.emplace(job->fn());
+                }
+            } catch (...) {
+                job->error = std::current_exception();
+            }
+            job->ready.store(true, std::memory_order_release);
+            job->ready.notify_all();
+        }, node);
+        return Future<R>(std::move(job), this);
+    }
+
+    // Fire-and-forget: queue a task on the given node. Workers on that node pick it up first, other
+    // nodes only steal it when idle. The task is moved all the way from here to the worker that runs it.
+    // Queues are bounded: outside threads wait for room, a worker runs the task itself
+    // rather than block on a full queue that only workers can drain.
+    void post(Task task, int node = 0) {
+        if (enqueue(std::move(task), node)) wakeWorkers(1);
+    }
+
+    // post() for count tasks at once: one claim on the queue and one wakeup for the lot.
+    // The tasks are moved from.
+    void postBatch(Task* tasks, size_t count, int node = 0) {
+        ThreadSafeQueue<Task>& queue = *nodeQueues[node % nodeQueues.size()];
+        for (size_t i = 0; i < count; ++i) tasks[i].markQueued();
+        size_t queued = queue.tryPushBulk(tasks, count);
+        // The queue filled up: queue the rest one by one (or run them here, on a worker)
+        for (size_t i = queued; i < count; ++i) {
+            if (enqueue(std::move(tasks[i]), node)) ++queued;
+        }
+        wakeWorkers(queued);
+    }
+
+    // post() without the wakeup, so a run of posts to different nodes can share one wakeWorkers().
+    // Returns false if the calling worker had to run the task itself because the queue was full.
+    bool enqueue(Task task, int node = 0) {
+        ThreadSafeQueue<Task>& queue = *nodeQueues[node % nodeQueues.size()];
+        task.markQueued();
+        if (tlsWorker >= 0) {
+            if (!queue.tryPush(std::move(task))) {
+                task();
+                return false;
+            }
+        } else {
+            queue.push(std::move(task));
+        }
+        return true;
+    }
+
+    // Make sure up to count idle workers come looking for the tasks just queued. Workers that are
+    // still spinning will find them on their own, so only the rest are unparked, in one futex call.
+    void wakeWorkers(size_t count) {
+        if (count == 0) return;
+        // Pairs with the increments of spinning/sleepers in idleWait(): either we see the waiter, or it sees the tasks
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        size_t spinners = spinning.load();
+        if (count <= spinners || sleepers.load() == 0) return;
+        parkSeq.fetch_add(1, std::memory_order_release);
+        futexWake(parkSeq, int(std::min<size_t>(count - spinners, INT_MAX)));
+    }
+
+    // Run body(i) for every i in [begin, end) across the pool and return once all of them are done.
+    // The range is cut into chunks of `grain` indices (0 picks about four chunks per thread) that
+    // workers and the calling thread claim from a shared counter. The caller works too, so this
+    // finishes even when called from inside a task with every other worker busy.
+    template<typename Body>
+    void parallelFor(size_t begin, size_t end, Body&& body, size_t grain = 0) {
+        forEachChunk(begin, end, grain, [&body](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i) body(i);
+        });
+    }
+
+    // Fold map(i) over [begin, end) with combine, starting from identity. Each thread folds its
+    // chunks into its own cache-line-padded partial, and the partials are combined at the end,
+    // so threads never write to a shared total.
+    template<typename T, typename Map, typename Combine>
+    T parallelReduce(size_t begin, size_t end, T identity, Map&& map, Combine&& combine, size_t grain = 0) {
+        std::vector<Padded<T>> partials(workers.size() + 1, Padded<T>{identity});
+        forEachChunk(begin, end, grain, [&](size_t first, size_t last) {
+            T local = identity;
+            for (size_t i = first; i < last; ++i) local = combine(std::move(local), map(i));
+            // Workers use their own slot, the calling thread (if it isn't a worker) the last one
+            Padded<T>& mine = partials[tlsWorker >= 0 ? tlsWorker : workers.size()];
+            mine.value = combine(std::move(mine.value), std::move(local));
+        });
+
+        T total = identity;
+        for (Padded<T>& partial : partials) total = combine(std::move(total), std::move(partial.value));
+        return total;
+    }
+
+    // Block until value equals target. A worker keeps running queued tasks while it waits (the one it
+    // waits on may be among them), any other thread sleeps on value.
+    template<typename T>
+    void waitFor(const std::atomic<T>& value, T target) {
+        trace::Span span("wait", "pool");
+        for (T seen = value.load(std::memory_order_acquire); seen != target; seen = value.load(std::memory_order_acquire)) {
+            if (tlsWorker < 0) {
+                value.wait(seen, std::memory_order_acquire);
+            } else if (!runPending()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // Block until every queued task has run and all workers are idle, so no task outlives
+    // the locals it captured by reference
+    void waitIdle() {
+        std::unique_lock<ProfiledMutex> lock(mtx);
+        ++idleWaiters;
+        idleCv.wait(lock, [this]() {return activeTasks == 0 && !hasWork(); });
+        --idleWaiters;
+    }
+
+    // Nodes that actually have workers. Combatant partitions are only placed on these.
+    std::vector<int> activeNodes() const {
+        std::vector<int> nodes(workerNodes.begin(), workerNodes.end());
+        std::sort(nodes.begin(), nodes.end());
+        nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+        return nodes;
+    }
+
+    size_t size() const { return workers.size(); }
+    size_t pinned() const { return pinnedCount; }
+    size_t numNodes() const { return topo.numNodes(); }
+    const NumaTopology& topology() const { return topo; }
+
+    // Node of the calling thread, -1 if it isn't one of our workers
+    static int currentNode() { return tlsNode; }
+    // Index of the calling worker, -1 outside the pool
+    static int currentWorker() { return tlsWorker; }
+
+    // Record whether the calling thread touched data that lives on its own node. dataNode is where
+    // the data's pages were found to be (nodeOfPages()), -1 if that isn't known.
+    void recordAccess(int dataNode) {
+        AccessCounter& counter = accessCounters[tlsWorker >= 0 ? tlsWorker : accessCounters.size() - 1];
+        if (dataNode < 0) {
+            ++counter.unplaced;
+        } else if (dataNode == tlsNode) {
+            ++counter.local;
+        } else {
+            ++counter.remote;
+        }
+    }
+
+    AccessCounter accessTotals() const {
+        AccessCounter total;
+        for (const AccessCounter& counter : accessCounters) {
+            total.local += counter.local;
+            total.remote += counter.remote;
+            total.unplaced += counter.unplaced;
+        }
+        return total;
+    }
+
+private:
+    void worker(int index, int node) {
+        static metrics::Histogram& taskWaitNs = metrics::histogram("pool.task_wait_ns");
+        tlsWorker = index;
+        tlsNode = node;
+        trace::setThreadName("worker " + std::to_string(index) + " (node " + std::to_string(node) + ")");
+        std::chrono::nanoseconds spinWindow = idle.spin;
+        while (true) {
+            // Count ourselves active before popping, so waitIdle() never sees an empty queue and no active tasks
+            // while a task is in our hands
+            Task task;
+            ++activeTasks;
+            if (popPreferLocal(node, task)) {
+                taskWaitNs.record(task.queuedFor());
+                trace::Span span("task", "pool");
+                task(); //execute the task
+            }
+            // Only take the mutex when someone is actually in waitIdle()
+            if (--activeTasks == 0 && idleWaiters.load() > 0 && !hasWork()) {
+                std::lock_guard<ProfiledMutex> lock(mtx);
+                idleCv.notify_all();
+            }
+            if (task) continue;
+
+            if (!idleWait(spinWindow)) return;
+        }
+    }
+
+    // Nothing anywhere: wait for work as the IdlePolicy says. Returns false once the pool is stopping.
+    bool idleWait(std::chrono::nanoseconds& spinWindow) {
+        // Spinning. Posts skip waking as many workers as are spinning, since those will see the work.
+        if (spinWindow.count() > 0) {
+            ++spinning;
+            auto deadline = std::chrono::steady_clock::now() + spinWindow;
+            bool found = false;
+            while (!found && std::chrono::steady_clock::now() < deadline) {
+                for (int i = 0; i < 32 && !(found = hasWork()); ++i) cpuRelax();
+            }
+            --spinning;
+            if (found) {
+                spinWindow = std::min(idle.spin, spinWindow * 2);
+                return true;
+            }
+            spinWindow = std::max(idle.spin / 16, spinWindow / 2);
+        }
+
+        for (unsigned i = 0; i < idle.yields; ++i) {
+            std::this_thread::yield();
+            if (hasWork()) return true;
+        }
+
+        // Park. Registering as a sleeper before the final check means a post racing with us either
+        // sees the sleeper (and bumps parkSeq, so the futex wait returns at once) or we see its task.
+        uint32_t seq = parkSeq.load(std::memory_order_acquire);
+        ++sleepers;
+        if (!stopFlag && !hasWork()) {
+            trace::Span span("parked", "pool");
+            futexWait(parkSeq, seq);
+        }
+        --sleepers;
+        return !(stopFlag && !hasWork());
+    }
+
+    bool hasWork() {
+        for (auto& queue : nodeQueues) {
+            if (!queue->empty()) return true;
+        }
+        return false;
+    }
+
+    // Give each thread's partial result its own cache line
+    template<typename T>
+    struct alignas(64) Padded {
+        T value;
+    };
+
+    // Shared between the caller of forEachChunk and its helper tasks. Helpers hold a reference,
+    // so one that only starts after the caller returned still finds valid counters (and no chunks left).
+    struct ChunkLoop {
+        size_t begin, end, grain, chunks;
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+    };
+
+    template<typename ChunkBody>
+    void forEachChunk(size_t begin, size_t end, size_t grain, ChunkBody&& chunkBody) {
+        if (begin >= end) return;
+        size_t count = end - begin;
+        size_t threads = workers.size() + 1;
+        if (grain == 0) grain = std::max<size_t>(1, count / (threads * 4));
+        size_t chunks = (count + grain - 1) / grain;
+        if (chunks == 1) {
+            chunkBody(begin, end);
+            return;
+        }
+
+        auto loop = std::make_shared<ChunkLoop>();
+        loop->begin = begin;
+        loop->end = end;
+        loop->grain = grain;
+        loop->chunks = chunks;
+
+        // Claim chunks until none are left. chunkBody is only touched for a claimed chunk, and the
+        // caller doesn't return before every claimed chunk is done, so the reference stays valid.
+        auto work = [&chunkBody](ChunkLoop& loop) {
+            for (size_t chunk = loop.next++; chunk < loop.chunks; chunk = loop.next++) {
+                size_t first = loop.begin + chunk * loop.grain;
+                chunkBody(first, std::min(first + loop.grain, loop.end));
+                if (loop.done.fetch_add(1) + 1 == loop.chunks) loop.done.notify_all();
+            }
+        };
+
+        // Helpers are queued in one batch on the caller's node, other nodes steal them if they're idle
+        size_t helpers = std::min(workers.size(), chunks - 1);
+        std::vector<Task> batch;
+        batch.reserve(helpers);
+        for (size_t h = 0; h < helpers; ++h) {
+            batch.emplace_back([loop, work]() { work(*loop); });
+        }
+        postBatch(batch.data(), batch.size(), tlsNode >= 0 ? tlsNode : 0);
+        work(*loop);
+
+        for (size_t done = loop->done.load(); done < chunks; done = loop->done.load()) {
+            loop->done.wait(done);
+        }
+    }
+
+    // Run one queued task on the calling worker, if there is one
+    bool runPending() {
+        Task task;
+        if (!popPreferLocal(tlsNode, task)) return false;
+        task();
+        return true;
+    }
+
+    // Own node first, then steal from the nearest other node
+    bool popPreferLocal(int node, Task& task) {
+        size_t numQueues = nodeQueues.size();
+        for (size_t offset = 0; offset < numQueues; ++offset) {
+            if (nodeQueues[(node + offset) % numQueues]->tryPop(task)) return true;
+        }
+        return false;
+    }
+
+    std::vector<std::thread> workers;
+    std::vector<int> workerNodes;
+    std::vector<std::unique_ptr<ThreadSafeQueue<Task>>> nodeQueues;    // one queue per NUMA node
+    std::vector<AccessCounter> accessCounters;
+    ProfiledMutex mtx{"pool"};
+    std::condition_variable_any idleCv;
+    std::atomic<size_t> activeTasks{0};
+    std::atomic<size_t> idleWaiters{0};
+    std::atomic<size_t> spinning{0};
+    std::atomic<size_t> sleepers{0};
+    std::atomic<uint32_t> parkSeq{0};      // futex word parked workers sleep on, bumped by every wakeup
+    std::atomic<bool> stopFlag;
+    NumaTopology topo;
+    IdlePolicy idle;
+    size_t pinnedCount = 0;
+
+    static constexpr size_t kQueueCapacity = 4096;
+
+    inline static thread_local int tlsWorker = -1;
+    inline static thread_local int tlsNode = -1;
+};
+
+template<typename T>
+void Future<T>::wait() const {
+    pool->waitFor(state->ready, true);
+}
+
+// Work split into steps with dependencies, such as the phases of a battle tick. A step is queued
+// the moment its last dependency finishes, so independent steps overlap on the pool and nobody
+// waits on a phase that doesn't concern them. Build the graph once and run() it as often as needed.
+// Steps must not form a cycle.
+class TaskGraph {
+public:
+    using Step = size_t;
+
+    // fn runs on a worker of node every time the graph runs. name labels the step on trace timelines.
+    template<typename F>
+    Step add(F&& fn, int node = 0, const char* name = "step") {
+        StepState& step = steps.emplace_back();
+        step.fn = Task(std::forward<F>(fn));
+        step.node = node;
+        step.name = name;
+        return steps.size() - 1;
+    }
+
+    // after only starts once before has finished
+    void precede(Step before, Step after) {
+        steps[before].successors.push_back(after);
+        ++steps[after].dependencies;
+    }
+
+    size_t size() const { return steps.size(); }
+
+    // Run every step once, respecting dependencies, and return when all of them are done
+    void run(ThreadPool& pool) {
+        if (steps.empty()) return;
+        remaining.store(steps.size(), std::memory_order_relaxed);
+        for (StepState& step : steps) step.pending.store(step.dependencies, std::memory_order_relaxed);
+        size_t roots = 0;
+        for (Step s = 0; s < steps.size(); ++s) {
+            if (steps[s].dependencies == 0 && enqueue(pool, s)) ++roots;
+        }
+        pool.wakeWorkers(roots);
+        pool.waitFor(remaining, size_t(0));
+    }
+
+private:
+    static constexpr Step kNone = ~Step(0);
+
+    struct StepState {
+        Task fn;
+        int node = 0;
+        const char* name = "step";
+        std::vector<Step> successors;
+        size_t dependencies = 0;
+        std::atomic<size_t> pending{0};     // dependencies not yet finished in the current run
+    };
+
+    bool enqueue(ThreadPool& pool, Step s) {
+        return pool.enqueue([this, &pool, s]() { execute(pool, s); }, steps[s].node);
+    }
+
+    // Run a step, then release its successors with one wakeup between them. One successor that
+    // belongs on this node is run right here instead of taking a trip through the queue.
+    void execute(ThreadPool& pool, Step s) {
+        while (s != kNone) {
+            StepState& step = steps[s];
+            {
+                trace::Span span(step.name, "graph");
+                step.fn();
+            }
+
+            Step next = kNone;
+            size_t queued = 0;
+            for (Step successor : step.successors) {
+                if (steps[successor].pending.fetch_sub(1, std::memory_order_acq_rel) != 1) continue;
+                if (next == kNone && steps[successor].node % pool.numNodes() == size_t(ThreadPool::currentNode())) {
+                    next = successor;
+                } else if (enqueue(pool, successor)) {
+                    ++queued;
+                }
+            }
+            pool.wakeWorkers(queued);
+            if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) remaining.notify_all();
+            s = next;
+        }
+    }
+
+    std::deque<StepState> steps;    // deque so steps (and their atomics) never move as the graph grows
+    std::atomic<size_t> remaining{0};
+};
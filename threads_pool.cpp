@@ -1,8 +1,11 @@
 // Simple thread demonstration using a thread pool and queue
-// There are more elaborate solutions to make the global print
-// update on time without the wait. Additionally, it would be interesting
-// to see how the sum could be updated as the threads run, but locking
-// after every update defeats the purpose of multithreading.
+// The pool counts unfinished tasks, so main can waitAll() instead of sleeping and hoping.
+// enqueueTask() is fire-and-forget, submit() returns a std::future for the task's result.
+// An idle worker spins and then yields for a while, watching an atomic count of queued tasks,
+// before it blocks on the condition variable (a futex underneath), and enqueueTask() only
+// notifies when a worker is actually blocked. Back-to-back tasks skip the sleep/wake round trip.
+// Each task hands back its own sum rather than locking a global after every update,
+// which would defeat the purpose of multithreading. main adds them up once they're done.
 
 #include <iostream>
 #include <thread>
@@ -14,39 +17,63 @@
 #include <condition_variable>
 #include <functional>
 #include <atomic>
+#include <future>
+#include <memory>
+#include <type_traits>
+
+#include "profiled_mutex.h"
 
 class ThreadPool {
 private:
     std::vector<std::thread> workers;           // Threads in the pool
     std::queue<std::function<void()>> tasks;    // Task queue
-    std::mutex queueMutex;                      // Mutex to protect the task queue
-    std::condition_variable condition;          // Signals tasks are available
+    ProfiledMutex queueMutex{"queue"};          // Mutex to protect the task queue, profiled with -DBUGHUNT_METRICS=1
+    std::condition_variable_any condition;      // Signals tasks are available
+    std::condition_variable_any allDone;        // Signals the last unfinished task completed
+    size_t unfinished = 0;                      // Tasks queued or running, protected by queueMutex
+    size_t sleeping = 0;                        // Workers blocked on condition, protected by queueMutex
+    std::atomic<size_t> queued {0};             // Tasks waiting in the queue, read without the lock
+    int spinLimit;                              // Checks of queued before blocking, half spinning, half yielding
 
 public:
     std::atomic<bool> stop {false};             // Flag to stop the pool
     
-    ThreadPool(size_t numThreads){
+    // Higher spinLimit: quicker pickup of the next task, more CPU spent idle. 0 blocks straight away.
+    ThreadPool(size_t numThreads, int spinLimit = 2000) : spinLimit(spinLimit) {
         for (size_t i = 0; i < numThreads; i++) {
             workers.emplace_back([this]() {
                 while(true) {
                     std::function<void()> task;
 
+                    // Wait for work without the lock first
+                    for (int spin = 0; spin < this->spinLimit && this->queued == 0 && !this->stop; ++spin) {
+                        if (spin >= this->spinLimit / 2) std::this_thread::yield();
+                    }
+
                     {
-                        std::unique_lock<std::mutex> lock(this->queueMutex);
+                        std::unique_lock<ProfiledMutex> lock(this->queueMutex);
 
                         // Wait until the queue has tasks or the stop is true
+                        ++this->sleeping;
                         this->condition.wait(lock, [this]() {
                             return !this->tasks.empty() || this->stop;
                         });
+                        --this->sleeping;
 
                         if (this->stop && this->tasks.empty()) return;
 
                         //Get the next task from the queue
                         task = std::move(this->tasks.front());
                         this->tasks.pop();
+                        --this->queued;
                     }
 
                     task();
+
+                    {
+                        std::unique_lock<ProfiledMutex> lock(this->queueMutex);
+                        if (--this->unfinished == 0) this->allDone.notify_all();
+                    }
                 }
             });
         }
@@ -54,7 +81,7 @@ public:
 
     ~ThreadPool(){
         {
-            std::unique_lock<std::mutex> lock(queueMutex);
+            std::unique_lock<ProfiledMutex> lock(queueMutex);
             stop = true;
         }
 
@@ -66,38 +93,46 @@ public:
     }
 
     void enqueueTask(std::function<void()> task) {
+        bool wake;
         {
-            std::unique_lock<std::mutex> lock(queueMutex);
+            std::unique_lock<ProfiledMutex> lock(queueMutex);
             tasks.push(std::move(task));
+            ++unfinished;
+            ++queued;
+            wake = sleeping > 0;    // a spinning worker will see queued go up by itself
         }
-        condition.notify_one();
+        if (wake) condition.notify_one();
     }
 
+    // Queue a task and get a future for whatever it returns.
+    // std::function needs a copyable callable, so the packaged_task is held by a shared_ptr.
+    template<typename F>
+    auto submit(F&& fn) -> std::future<std::invoke_result_t<F&>> {
+        auto task = std::make_shared<std::packaged_task<std::invoke_result_t<F&>()>>(std::forward<F>(fn));
+        std::future<std::invoke_result_t<F&>> result = task->get_future();
+        enqueueTask([task]() { (*task)(); });
+        return result;
+    }
+
+    // Block until every task enqueued so far has finished
+    void waitAll() {
+        std::unique_lock<ProfiledMutex> lock(queueMutex);
+        allDone.wait(lock, [this]() { return unfinished == 0; });
+    }
 
-};
 
+};
 
-// shared globak
-int globalSum = 0;
 
-std::mutex mtx;
 std::mutex printMtx;
 
 // Function to be executed by each thread
-void incrementMyVar(int threadID, int iterations) {
+int incrementMyVar(int threadID, int iterations) {
     int localSum = 0;   //each thread maintains its own sum
 	for (int i = 1; i < iterations; i++) {
 		localSum += threadID;		//each thread increments its local variable
     }
 
-    // Lock and update the global sum 
-    // CAN be done this way to reduce complexity, but now threads cannot sum in parallel, reducing performance
-    {
-        std::lock_guard<std::mutex> lock(mtx);
-        globalSum += localSum;
-        //std::cout << "Thread " << threadID << " completed with local sum: " << localSum << std::endl;
-    }
-
     // Lock and print the global sum
     // CAN be done this way to thread sum in parallel, but increases complexity and contention for the lock
     {
@@ -105,29 +140,34 @@ void incrementMyVar(int threadID, int iterations) {
         std::cout << "Thread " << threadID << " completed with local sum: " << localSum << std::endl;
     }
 
+    return localSum;
 }
 
 int main() {
     const int numThreads = 10;
     const int numTasks = 10;
     ThreadPool pool(numThreads);
+    std::vector<std::future<int>> sums;
 
     srand(time(0));
 
 	// Submit tasks to the thread pool
 	for (int i = 0; i < numTasks; i++) {
         int iterations = rand()  % 10 + 1;
-		// Pass the local variable by reference to each thread
-		pool.enqueueTask([i, iterations]() {
-            incrementMyVar(i, iterations);
-        });
+		// Each task's sum comes back through its future
+		sums.push_back(pool.submit([i, iterations]() {
+            return incrementMyVar(i, iterations);
+        }));
     }
 
-
-    // Allow some time for all tasks to complete
-    // By far the easiest way to get this to print the right way
-    std::this_thread::sleep_for(std::chrono::seconds(1));
+    // get() waits for exactly as long as each task takes, then the sums are merged on this thread
+    int globalSum = 0;
+    for (std::future<int>& sum : sums) {
+        globalSum += sum.get();
+    }
+    pool.waitAll();
     std::cout << "Global sum total is: " << globalSum << std::endl;
+    metrics::dump(std::cout);
 
     return 0;
 }
@@ -1,5 +1,7 @@
 // Simple thread demonstration creating a vector of threads to perform
 // individual incrementation and then updating a global.
+// Each thread's counter is padded out to its own cache line. Packed side by side in a
+// vector<int>, ten counters share a line or two and every increment bounces it between cores.
 
 #include <iostream>
 #include <thread>
@@ -11,6 +13,11 @@ int myVar = 0;
 
 std::mutex mtx;
 
+// A counter alone on its cache line
+struct alignas(64) PaddedCounter {
+    int value = 0;
+};
+
 // Function to be executed by each thread
 void incrementMyVar(int threadNum, int& threadVar) {
 	int iterations = rand() + threadNum;
@@ -21,13 +28,13 @@ void incrementMyVar(int threadNum, int& threadVar) {
 
 int main() {
 	std::vector<std::thread> threads;
-	std::vector<int> threadVars(10,0);	//create a vector to store 10 thread’s local var, init at 0
+	std::vector<PaddedCounter> threadVars(10);	//create a vector to store 10 thread’s local var, init at 0
     srand(time(0));
 
 	//Create threads
 	for (int i = 0; i < threadVars.size(); i++) {
 		// Pass the local variable by reference to each thread
-		threads.emplace_back(incrementMyVar, i, std::ref(threadVars[i]));
+		threads.emplace_back(incrementMyVar, i, std::ref(threadVars[i].value));
     }
 
     // Join threads once their work is done
@@ -36,7 +43,7 @@ int main() {
     }
 
     for (int i = 0; i < threadVars.size(); i++){
-        std::cout << threadVars[i] << " for thread " << i << ".\n";
+        std::cout << threadVars[i].value << " for thread " << i << ".\n";
     }
 
     // Lock and add all the local vars together
@@ -44,7 +51,7 @@ int main() {
     for (const auto& threadVar : threadVars) {
 	{
 	    std:: lock_guard<std::mutex> lock(mtx);
-        myVar+= threadVar;
+        myVar+= threadVar.value;
     }
     }
 
@@ -0,0 +1,195 @@
+// Timeline tracing in Chrome's trace-event format, for opening a run in chrome://tracing or
+// ui.perfetto.dev. Build with -DBUGHUNT_TRACE=1 and create a trace::Session to record. Otherwise
+// every type below is an empty stub and the instrumentation compiles away.
+//
+// Each thread appends spans (name, start, duration) to its own buffer, so recording takes no lock
+// and touches no memory shared with other threads: just two clock reads and a vector append.
+// Buffers stay registered after their thread exits, and the Session writes them all out as JSON
+// when it is destroyed. Names must be string literals (or otherwise outlive the session).
+//
+//     trace::Session session("battle.json");     // before the pool, so it outlives the workers
+//     ...
+//     { trace::Span span("damage Bugs", "tick"); applyStrikes(false); }
+
+#pragma once
+
+#ifndef BUGHUNT_TRACE
+#define BUGHUNT_TRACE 0
+#endif
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#if BUGHUNT_TRACE
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#endif
+
+namespace trace {
+
+#if BUGHUNT_TRACE
+
+constexpr bool kEnabled = true;
+
+inline uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Event {
+    const char* name;
+    const char* category;
+    uint64_t start;     // ns
+    uint64_t duration;  // ns
+};
+
+// One thread's events. Owned by the Recorder so they survive the thread.
+struct ThreadBuffer {
+    int tid;
+    std::string threadName;
+    std::vector<Event> events;
+};
+
+class Recorder {
+public:
+    static Recorder& instance() {
+        static Recorder recorder;
+        return recorder;
+    }
+
+    bool recording() const { return on.load(std::memory_order_relaxed); }
+
+    // The calling thread's buffer, registered on first use
+    ThreadBuffer& mine() {
+        thread_local ThreadBuffer* buffer = nullptr;
+        if (!buffer) {
+            std::lock_guard<std::mutex> lock(mtx);
+            buffers.push_back(std::make_unique<ThreadBuffer>());
+            buffer = buffers.back().get();
+            buffer->tid = int(buffers.size());
+            buffer->threadName = "thread " + std::to_string(buffer->tid);
+            buffer->events.reserve(1 << 16);    // grow rarely while recording
+        }
+        return *buffer;
+    }
+
+    void start() {
+        origin = nowNs();
+        on.store(true, std::memory_order_relaxed);
+    }
+
+    // Stop recording and write every thread's events as a trace-event JSON file
+    void write(const std::string& path) {
+        on.store(false, std::memory_order_relaxed);
+        std::ofstream out(path);
+        if (!out) {
+            std::cerr << "trace: can't write " << path << "\n";
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mtx);
+        size_t total = 0;
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+        bool first = true;
+        auto separator = [&]() -> std::ostream& {
+            if (!first) out << ",\n";
+            first = false;
+            return out;
+        };
+        out << std::fixed << std::setprecision(3);
+        for (const auto& buffer : buffers) {
+            separator() << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << buffer->tid
+                        << ",\"args\":{\"name\":\"" << buffer->threadName << "\"}}";
+            for (const Event& event : buffer->events) {
+                if (event.start < origin) continue;
+                // Complete events, times in microseconds
+                separator() << "{\"ph\":\"X\",\"name\":\"" << event.name << "\",\"cat\":\"" << event.category
+                            << "\",\"pid\":1,\"tid\":" << buffer->tid << ",\"ts\":" << (event.start - origin) / 1000.0
+                            << ",\"dur\":" << event.duration / 1000.0 << "}";
+            }
+            total += buffer->events.size();
+        }
+        out << "\n]}\n";
+        std::cout << "Trace: " << total << " events from " << buffers.size() << " threads written to " << path << ".\n";
+    }
+
+private:
+    std::atomic<bool> on{false};
+    uint64_t origin = 0;
+    std::mutex mtx;
+    std::deque<std::unique_ptr<ThreadBuffer>> buffers;
+};
+
+// Label the calling thread in the viewer, eg "worker 3 (node 1)". Ignored when not recording.
+inline void setThreadName(const std::string& name) {
+    if (Recorder::instance().recording()) Recorder::instance().mine().threadName = name;
+}
+
+// Records the time from construction to destruction as one span on the calling thread.
+// Costs a relaxed load when no session is recording.
+class Span {
+public:
+    Span(const char* name, const char* category) : name(name), category(category),
+        start(Recorder::instance().recording() ? nowNs() : 0) {}
+
+    ~Span() {
+        if (start == 0) return;
+        uint64_t end = nowNs();
+        Recorder::instance().mine().events.push_back({name, category, start, end - start});
+    }
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+private:
+    const char* name;
+    const char* category;
+    uint64_t start;
+};
+
+// Records from construction and writes the file on destruction. An empty path records nothing.
+class Session {
+public:
+    explicit Session(std::string path) : path(std::move(path)) {
+        if (!this->path.empty()) Recorder::instance().start();
+    }
+
+    ~Session() {
+        if (!path.empty()) Recorder::instance().write(path);
+    }
+
+private:
+    std::string path;
+};
+
+#else
+
+// Tracing off: same interface, nothing recorded
+
+constexpr bool kEnabled = false;
+
+inline void setThreadName(const std::string&) {}
+
+class Span {
+public:
+    Span(const char*, const char*) {}
+};
+
+class Session {
+public:
+    explicit Session(const std::string& path) {
+        if (!path.empty()) std::fprintf(stderr, "trace: built without -DBUGHUNT_TRACE=1, not writing %s\n", path.c_str());
+    }
+};
+
+#endif
+
+} // namespace trace
@@ -0,0 +1,124 @@
+// Turn-by-turn statistics of a battle in a fixed amount of memory, however long it runs.
+// Each turn is summed into a TurnStats (soldiers standing at its end, and each side's attacks, hits,
+// crits, kills and blows turned by the enemy's saves) and recorded in a TurnSeries. The series holds
+// at most `capacity` entries. When it fills up, neighbouring entries are merged pairwise and every
+// entry from then on covers twice as many turns, so the whole battle's curve is always there at an
+// even resolution. Totals are kept exactly on the side.
+//     TurnSeries series(256);
+//     series.record(turn);             // once per turn
+//     series.writeCsv(out);            // turn,last_turn,marines_alive,...
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// What one side did over some turns
+struct SideTally {
+    uint64_t attacks = 0;
+    uint64_t hits = 0;
+    uint64_t crits = 0;
+    uint64_t kills = 0;
+    uint64_t saved = 0;     // killing blows the enemy's one-time saves turned away
+
+    void add(const SideTally& other) {
+        attacks += other.attacks;
+        hits += other.hits;
+        crits += other.crits;
+        kills += other.kills;
+        saved += other.saved;
+    }
+};
+
+// Turns firstTurn to lastTurn of a battle
+struct TurnStats {
+    uint32_t firstTurn = 0;
+    uint32_t lastTurn = 0;
+    uint64_t marinesAlive = 0;  // at the end of lastTurn
+    uint64_t bugsAlive = 0;
+    SideTally marines;
+    SideTally bugs;
+
+    // Extends this span with the one right after it
+    void merge(const TurnStats& later) {
+        lastTurn = later.lastTurn;
+        marinesAlive = later.marinesAlive;
+        bugsAlive = later.bugsAlive;
+        marines.add(later.marines);
+        bugs.add(later.bugs);
+    }
+};
+
+class TurnSeries {
+public:
+    // capacity is rounded up to an even number, at least 2
+    explicit TurnSeries(size_t capacity = 256) : capacity(capacity < 2 ? 2 : capacity + (capacity & 1)) {
+        series.reserve(this->capacity);
+    }
+
+    void record(const TurnStats& turn) {
+        if (turns == 0) {
+            sum = turn;
+        } else {
+            sum.merge(turn);
+        }
+        ++turns;
+
+        if (pendingTurns == 0) {
+            pending = turn;
+        } else {
+            pending.merge(turn);
+        }
+        if (++pendingTurns < turnsPerEntry) return;
+
+        series.push_back(pending);
+        pendingTurns = 0;
+        if (series.size() == capacity) halve();
+    }
+
+    // Entries in turn order, with the turns not yet making up a whole entry as a last partial one
+    std::vector<TurnStats> entries() const {
+        std::vector<TurnStats> all = series;
+        if (pendingTurns > 0) all.push_back(pending);
+        return all;
+    }
+
+    // The whole battle as one span
+    const TurnStats& totals() const { return sum; }
+    uint64_t turnsRecorded() const { return turns; }
+    uint64_t turnsPerPoint() const { return turnsPerEntry; }
+
+    void writeCsv(std::ostream& out) const {
+        out << "turn,last_turn,marines_alive,bugs_alive,"
+               "marine_attacks,marine_hits,marine_crits,marine_kills,marine_saved,"
+               "bug_attacks,bug_hits,bug_crits,bug_kills,bug_saved\n";
+        for (const TurnStats& entry : entries()) {
+            out << entry.firstTurn << ',' << entry.lastTurn << ',' << entry.marinesAlive << ',' << entry.bugsAlive;
+            for (const SideTally* side : {&entry.marines, &entry.bugs}) {
+                out << ',' << side->attacks << ',' << side->hits << ',' << side->crits << ',' << side->kills << ',' << side->saved;
+            }
+            out << '\n';
+        }
+    }
+
+private:
+    // Merges neighbouring entries, so the series has room for as many again at half the resolution
+    void halve() {
+        for (size_t i = 0; i < series.size() / 2; ++i) {
+            series[i] = series[2 * i];
+            series[i].merge(series[2 * i + 1]);
+        }
+        series.resize(series.size() / 2);
+        turnsPerEntry *= 2;
+    }
+
+    size_t capacity;
+    std::vector<TurnStats> series;
+    uint64_t turnsPerEntry = 1;
+    TurnStats pending;
+    uint64_t pendingTurns = 0;
+    TurnStats sum;
+    uint64_t turns = 0;
+};
@@ -0,0 +1,82 @@
+// Unit types as data. A registry starts with the Marine and Bug and can load a table of types, so a
+// new unit is a row in a file rather than a new class:
+//     # name     health  accuracy  damage  crit  heal  rules
+//     Marine     100     7         50      10    0     -
+//     Bug        100     8         50      10    50    save,piercing
+//     Warrior    150     8         60      10    50    save,piercing
+//     Sniper     80      5         70      9     0     piercing
+// An attack hits when a d10 rolls above accuracy, and a roll of crit is a critical hit for double
+// damage. Rules: save survives the first killing blow and heals `heal`, piercing crits ignore saves.
+// A row with the name of a type already in the registry replaces it.
+// soldier_w_turns and scenario_convert take the table with --units=FILE.
+
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "battle_state.h"
+
+class UnitRegistry {
+public:
+    UnitRegistry() : types(defaultUnitTypes()) {}
+
+    void add(const UnitType& type) {
+        auto existing = std::find_if(types.begin(), types.end(), [&](const UnitType& t) { return std::strcmp(t.name, type.name) == 0; });
+        if (existing != types.end()) {
+            *existing = type;
+        } else {
+            types.push_back(type);
+        }
+    }
+
+    // Adds every row of a table. name is only used in error messages.
+    void load(std::istream& in, const std::string& name) {
+        std::string line;
+        int lineNumber = 0;
+        while (std::getline(in, line)) {
+            ++lineNumber;
+            line = line.substr(0, line.find('#'));
+            std::istringstream row(line);
+            std::string typeName, rules;
+            int32_t health, accuracy, damage, crit, heal;
+            if (!(row >> typeName)) continue;
+            auto fail = [&](const std::string& what) {
+                return std::runtime_error(name + ":" + std::to_string(lineNumber) + ": " + what);
+            };
+            if (!(row >> health >> accuracy >> damage >> crit >> heal >> rules)) {
+                throw fail("expected name health accuracy damage crit heal rules");
+            }
+            if (typeName.size() >= sizeof(UnitType::name)) throw fail("unit names are at most 15 characters");
+
+            uint32_t flags = 0;
+            std::istringstream list(rules);
+            for (std::string rule; std::getline(list, rule, ',');) {
+                if (rule == "save") flags |= kOneTimeSave;
+                else if (rule == "piercing") flags |= kPiercingCrit;
+                else if (rule != "-") throw fail("unknown rule " + rule);
+            }
+            UnitType type = makeUnitType(typeName, health, accuracy, damage, crit, heal, flags);
+            std::string problem = unitTypeProblem(type);
+            if (!problem.empty()) throw fail(problem);
+            add(type);
+        }
+    }
+
+    const UnitType* find(const std::string& name) const {
+        for (const UnitType& type : types) {
+            if (name == type.name) return &type;
+        }
+        return nullptr;
+    }
+
+    const std::vector<UnitType>& all() const { return types; }
+
+private:
+    std::vector<UnitType> types;
+};